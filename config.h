@@ -143,15 +143,25 @@
  */
 #define SPARSE_HEAP_START (void *)0x2130051300000000UL
 
+/*
+ * Address space for mappings made with mem_map, right above the largest
+ * emulated heap
+ */
+#define SPARSE_MAP_START ((unsigned char *)SPARSE_HEAP_START + MAX_SPARSE_HEAP)
+#define MAX_SPARSE_MAP (1UL << 60)
+
 /*
  * Number of bytes in each page
  */
 #define SPARSE_PAGE_SIZE (1 << 10)
 
 /*
- * Maximum target load for hash table
+ * Maximum load (pages per bucket) of the sparse page table, which doubles
+ * once there are more pages than HASH_LOAD times its buckets.  At 0.5 there
+ * are at least two bucket pointers per page, under 2% of the pages, and a
+ * lookup walks about one page.
  */
-#define HASH_LOAD 10.0
+#define HASH_LOAD 0.5
 
 /***************** Parameters for looking up reference throughput *********/
 /*
@@ -0,0 +1,62 @@
+/*
+ * lathist.c - Log-linear latency histograms
+ *
+ * See lathist.h for the bucket layout.
+ */
+#include <math.h>
+#include <string.h>
+
+#include "lathist.h"
+
+/*
+ * bucket_top - the largest value counted by bucket i
+ */
+static uint64_t bucket_top(unsigned i)
+{
+    unsigned group = i >> LATHIST_SUB_BITS;
+    uint64_t sub = i & (LATHIST_SUB - 1);
+
+    if (group == 0)
+        return sub;
+    unsigned shift = group - 1;
+    uint64_t bottom = (LATHIST_SUB + sub) << shift;
+    return bottom + (((uint64_t)1 << shift) - 1);
+}
+
+void lathist_reset(lathist_t *h)
+{
+    memset(h, 0, sizeof(*h));
+}
+
+void lathist_merge(lathist_t *dst, const lathist_t *src)
+{
+    for (unsigned i = 0; i < LATHIST_BUCKETS; i++)
+        dst->buckets[i] += src->buckets[i];
+    dst->count += src->count;
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
+
+uint64_t lathist_quantile(const lathist_t *h, double q)
+{
+    uint64_t rank, seen = 0;
+
+    if (h->count == 0)
+        return 0;
+
+    /* The rank of the sample we are after, origin 1 */
+    rank = (uint64_t)ceil(q * (double)h->count);
+    if (rank < 1)
+        rank = 1;
+
+    for (unsigned i = 0; i < LATHIST_BUCKETS; i++)
+    {
+        seen += h->buckets[i];
+        if (seen >= rank)
+        {
+            uint64_t top = bucket_top(i);
+            return top < h->max ? top : h->max;
+        }
+    }
+    return h->max;
+}
@@ -0,0 +1,78 @@
+/*
+ * lathist.h - Log-linear latency histograms
+ *
+ * A histogram counts 64-bit samples (cycle counts, in the drivers) in
+ * buckets that are exact below 2^LATHIST_SUB_BITS and above that split each
+ * power of two into 2^LATHIST_SUB_BITS equal parts, so any recorded value
+ * is known to within about 3%. Recording a sample is a handful of
+ * instructions and never allocates, which keeps it cheap enough to wrap
+ * around every allocator call.
+ */
+#ifndef LATHIST_H
+#define LATHIST_H
+
+#include <stdint.h>
+#include <time.h>
+
+#define LATHIST_SUB_BITS 5
+#define LATHIST_SUB (1 << LATHIST_SUB_BITS)
+#define LATHIST_BUCKETS ((64 - LATHIST_SUB_BITS + 1) * LATHIST_SUB)
+
+typedef struct
+{
+    uint64_t count;                     /* number of samples */
+    uint64_t max;                       /* largest sample */
+    uint64_t buckets[LATHIST_BUCKETS];  /* samples per bucket */
+} lathist_t;
+
+/* Index of the bucket that counts value v */
+static inline unsigned lathist_bucket(uint64_t v)
+{
+    if (v < LATHIST_SUB)
+        return (unsigned)v;
+    unsigned shift = 63 - (unsigned)__builtin_clzll(v) - LATHIST_SUB_BITS;
+    return ((shift + 1) << LATHIST_SUB_BITS) + (unsigned)(v >> shift) -
+           LATHIST_SUB;
+}
+
+/* Add one sample to a histogram */
+static inline void lathist_record(lathist_t *h, uint64_t v)
+{
+    h->buckets[lathist_bucket(v)]++;
+    h->count++;
+    if (v > h->max)
+        h->max = v;
+}
+
+/*
+ * Read a free-running counter for timing single operations: the time stamp
+ * counter where there is one, and nanoseconds elsewhere. Its rate is not
+ * known; callers calibrate it against clock_gettime.
+ */
+static inline uint64_t lathist_now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    uint32_t lo, hi;
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi) : : "memory");
+    return ((uint64_t)hi << 32) | lo;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+/* Clear a histogram */
+void lathist_reset(lathist_t *h);
+
+/* Add the samples of src to dst */
+void lathist_merge(lathist_t *dst, const lathist_t *src);
+
+/*
+ * The value below which a fraction q (0 <= q <= 1) of the samples fall,
+ * rounded up to the top of its bucket but never above the largest sample.
+ * Returns 0 for an empty histogram.
+ */
+uint64_t lathist_quantile(const lathist_t *h, double q);
+
+#endif /* LATHIST_H */
@@ -7,7 +7,9 @@
  * Copyright (c) 2004-2016, R. Bryant and D. O'Hallaron, All rights
  * reserved.  May not be used, modified, or copied without permission.
  */
+#define _GNU_SOURCE /* for RTLD_DEEPBIND */
 #include <assert.h>
+#include <dlfcn.h>
 #include <errno.h>
 #include <float.h>
 #include <math.h>
@@ -27,9 +29,12 @@
 
 #include "config.h"
 #include "fcyc.h"
+#include "lathist.h"
 #include "memlib.h"
 #include "mm.h"
+#include "perfctr.h"
 #include "stree.h"
+#include "trace.h"
 
 /**********************
  * Constants and macros
@@ -45,6 +50,16 @@
 #define REF_ONLY 0
 #endif
 
+/* Fewest requests timed per trace when measuring latencies (-L) */
+#define LATENCY_MIN_SAMPLES 100000
+
+/* Points at which the heap is broken down over each trace (-F) */
+#define FRAG_SAMPLES 20
+
+/* Size of the block check_calloc asks for, above mm.c's default
+ * MMAP_THRESHOLD, so that it gets a mapping of its own */
+#define CALLOC_CHECK_BYTES (4 << 20)
+
 /* Returns true if p is ALIGNMENT-byte aligned */
 #define IS_ALIGNED(p) ((((unsigned long)(p)) % ALIGNMENT) == 0)
 
@@ -91,19 +106,6 @@ typedef struct
     tree_t *lo_tree;
 } range_set_t;
 
-/* Characterizes a single trace operation (allocator request) */
-typedef struct
-{
-    enum
-    {
-        ALLOC,
-        FREE,
-        REALLOC
-    } type;      /* type of request */
-    int index;   /* index for free() to use later */
-    size_t size; /* byte size of alloc/realloc request */
-} traceop_t;
-
 /* Holds the information for one trace file */
 typedef struct
 {
@@ -112,7 +114,8 @@ typedef struct
     int num_ids;          /* number of alloc/realloc ids */
     int num_ops;          /* number of distinct requests */
     weight_t weight;      /* weight for this trace */
-    traceop_t *ops;       /* array of requests */
+    traceop_t *ops;       /* array of requests, owned by file */
+    tracefile_t *file;    /* the loaded text or binary trace */
     char **blocks;        /* array of ptrs returned by malloc/realloc... */
     size_t *block_sizes;  /* ... and a corresponding array of payload sizes */
     size_t *block_rand_base; /* index into random_data, if debug is on */
@@ -123,12 +126,77 @@ typedef struct
  * This struct is necessary because fcyc accepts only a pointer array
  * as input.
  */
+typedef struct backend backend_t;
 typedef struct
 {
     trace_t *trace;
     range_set_t *ranges;
+    const backend_t *backend; /* for eval_backend_speed */
 } speed_t;
 
+/*
+ * An allocator that mdriver can measure.  Backends whose heap comes from
+ * memlib (mm.c, mm-naive.c) get the full set of checks and a utilization;
+ * the others (libc, shared objects loaded with -b) are only run.
+ */
+struct backend
+{
+    const char *name;
+    bool (*init)(void); /* NULL if there is nothing to initialize */
+    void *(*malloc)(size_t size);
+    void (*free)(void *ptr);
+    void *(*realloc)(void *ptr, size_t size);
+    bool (*checkheap)(int lineno); /* NULL if there is no heap checker */
+    bool memlib;                   /* does the heap live in memlib? */
+};
+
+/* Per-request latencies on one trace, measured with -L */
+typedef struct
+{
+    lathist_t hist[3];   /* counter ticks per call, by request type */
+    double ns_per_tick;  /* counter rate while the trace was replayed */
+} latency_t;
+
+/*
+ * Where the heap's bytes are after one request, measured with -F.  The
+ * payload plus the four kinds of overhead add up to the heap size.
+ */
+typedef struct
+{
+    int op;         /* the request after which the sample was taken */
+    size_t heap;    /* heap plus mappings, as for the utilization */
+    size_t payload; /* bytes the trace has asked for and not freed */
+    size_t header;  /* per-block headers of the live blocks */
+    size_t padding; /* rounding the requests up to the alignment */
+    size_t slack;   /* allocated blocks larger than their rounded request */
+    size_t free;    /* free blocks, external fragmentation */
+    size_t meta;    /* the allocator's own data structures */
+} frag_sample_t;
+
+/* The heap breakdown at FRAG_SAMPLES evenly spaced points of one trace */
+typedef struct
+{
+    int count;
+    frag_sample_t samples[FRAG_SAMPLES];
+} frag_t;
+
+/* One pass over the trace in a steady-state run, measured with -R */
+typedef struct
+{
+    double secs;         /* time taken by the trace's requests */
+    size_t peak_heap;    /* largest heap plus mappings during the pass */
+    size_t end_heap;     /* heap plus mappings once everything was freed */
+    size_t peak_payload; /* largest payload live at once */
+} steady_pass_t;
+
+/* The passes of a steady-state run, all on the same heap */
+typedef struct
+{
+    int count;              /* passes that ran to the end */
+    bool failed;            /* did the allocator run out of memory? */
+    steady_pass_t passes[]; /* room for steady_passes of them */
+} steady_t;
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct
 {
@@ -144,8 +212,15 @@ typedef struct
 
     /* defined only for the student malloc package */
     double util; /* space utilization for this trace (always 0 for libc) */
-
-    /* Note: secs and util are only defined if valid is true */
+    size_t heap_bytes; /* peak virtual heap + mapping size (0 for libc) */
+    size_t rss_bytes;  /* resident heap size at the end of the trace */
+    latency_t *latency; /* per-request latencies (NULL unless -L) */
+    perfctr_sample_t *counters; /* hardware counts (NULL unless -P) */
+    frag_t *frag; /* heap breakdown over the trace (NULL unless -F) */
+    steady_t *steady; /* repeated passes on one heap (NULL unless -R) */
+
+    /* Note: secs, util and the heap sizes are only defined if valid is
+     * true */
 } stats_t;
 
 /* Summarizes the key statistics for a set of traces */
@@ -188,6 +263,10 @@ int verbose = REF_ONLY ? 0 : 1; /* global flag for verbose output */
 static int errors = 0; /* number of errs found when running student malloc */
 static bool onetime_flag = false;
 static bool tab_mode = false; /* Print output as tab-separated fields */
+static bool latency_mode = false; /* Time each request on its own (-L) */
+static bool counter_mode = false; /* Read hardware counters (-P) */
+static bool frag_mode = false;    /* Break the heap down over time (-F) */
+static int steady_passes = 0;     /* Replay each trace this often on one heap */
 /* If set, use sparse memory emulation */
 static bool sparse_mode = SPARSE_MODE;
 static size_t maxfill = SPARSE_MODE ? MAXFILL_SPARSE : MAXFILL;
@@ -223,6 +302,30 @@ static sum_stats_t global_mm_sum_stats;
 
 /* Performance statistics for driver */
 
+/* mm-naive.c, compiled with its entry points renamed (see the Makefile) */
+bool naive_init(void);
+void *naive_malloc(size_t size);
+void naive_free(void *ptr);
+void *naive_realloc(void *ptr, size_t size);
+bool naive_checkheap(int lineno);
+
+/* The fragmentation hook of mm.c, which the reference allocators lack */
+#pragma weak mm_heapstats
+
+/* The allocators built into the driver */
+static const backend_t mm_backend = {"mm",    mm_init,      mm_malloc,
+                                     mm_free, mm_realloc,   mm_checkheap,
+                                     true};
+static const backend_t naive_backend = {
+    "naive",       naive_init,      naive_malloc, naive_free,
+    naive_realloc, naive_checkheap, true};
+static const backend_t libc_backend = {"libc", NULL, malloc, free,
+                                       realloc, NULL, false};
+
+/* The allocators to compare, given with -b */
+static const backend_t **backends = NULL;
+static int num_backends = 0;
+
 /*********************
  * Function prototypes
  *********************/
@@ -241,6 +344,7 @@ static void free_range_set(range_set_t *ranges);
 static void init_random_data(void);
 static bool check_index(const trace_t *trace, int opnum, int index);
 static void randomize_block(trace_t *trace, int index);
+static bool check_calloc(const trace_t *trace);
 
 /* These functions read, allocate, and free storage for traces */
 static trace_t *read_trace(stats_t *stats, const char *tracedir,
@@ -249,17 +353,33 @@ static void reinit_trace(trace_t *trace);
 static void free_trace(trace_t *trace);
 
 /* Routines for evaluating the correctness and speed of libc malloc */
-static bool eval_libc_valid(trace_t *trace);
+static bool eval_libc_valid(trace_t *trace, const backend_t *backend);
 static void eval_libc_speed(void *ptr);
 
 /* Routines for evaluating correctnes, space utilization, and speed
    of the student's malloc package in mm.c */
-static bool eval_mm_valid(trace_t *trace, range_set_t *ranges);
-static double eval_mm_util(trace_t *trace, int tracenum);
+static bool eval_mm_valid(trace_t *trace, range_set_t *ranges,
+                          const backend_t *backend);
+static double eval_mm_util(trace_t *trace, int tracenum, stats_t *stats,
+                           const backend_t *backend);
 static void eval_mm_speed(void *ptr);
+static void eval_mm_counters(trace_t *trace, perfctr_sample_t *counters);
+static void eval_mm_latency(trace_t *trace, latency_t *latency);
+static void eval_mm_frag(trace_t *trace, frag_t *frag);
+static void eval_mm_steady(trace_t *trace, steady_t *steady);
+
+/* Routines for comparing several allocators (-b) */
+static void add_backend(const char *name);
+static void eval_backend_speed(void *ptr);
+static void compare_backends(int num_tracefiles, const char *tracedir,
+                             char **tracefiles);
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats, sum_stats_t *sumstats);
+static void printlatency(int n, stats_t *stats);
+static void printcounters(int n, stats_t *stats);
+static void printfrag(int n, stats_t *stats);
+static void printsteady(int n, stats_t *stats);
 static void usage(char *prog);
 static void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
     __attribute__((format(printf, 3, 4)));
@@ -318,12 +438,12 @@ static void run_tests(int num_tracefiles, const char *tracedir,
                 printf("Checking mm_malloc for correctness, ");
             mm_stats[i].valid =
                 /* Do 2 tests, since may fail to reinitialize properly */
-                eval_mm_valid(trace, ranges);
+                eval_mm_valid(trace, ranges, &mm_backend);
 
 			free_range_set(ranges);
 			ranges = new_range_set();
 			mm_stats[i].valid = mm_stats[i].valid &&
-				eval_mm_valid(trace, ranges);
+				eval_mm_valid(trace, ranges, &mm_backend);
 
             if (onetime_flag)
             {
@@ -336,7 +456,8 @@ static void run_tests(int num_tracefiles, const char *tracedir,
         {
             if (verbose > 1)
                 printf("efficiency, ");
-            mm_stats[i].util = eval_mm_util(trace, i);
+            mm_stats[i].util =
+                eval_mm_util(trace, i, &mm_stats[i], &mm_backend);
             speed_params->trace = trace;
             speed_params->ranges = ranges;
             if (verbose > 1)
@@ -344,6 +465,44 @@ static void run_tests(int num_tracefiles, const char *tracedir,
             mm_stats[i].secs =
                 sparse_mode ? 1.0 : fsec(eval_mm_speed, speed_params);
             mm_stats[i].tput = mm_stats[i].ops / (mm_stats[i].secs * 1000.0);
+            if (latency_mode && !sparse_mode)
+            {
+                if (verbose > 1)
+                    printf("Timing each request.\n");
+                mm_stats[i].latency = calloc(1, sizeof(latency_t));
+                if (mm_stats[i].latency == NULL)
+                    unix_error("calloc failed in run_tests");
+                eval_mm_latency(trace, mm_stats[i].latency);
+            }
+            if (counter_mode && !sparse_mode)
+            {
+                if (verbose > 1)
+                    printf("Reading hardware counters.\n");
+                mm_stats[i].counters = malloc(sizeof(perfctr_sample_t));
+                if (mm_stats[i].counters == NULL)
+                    unix_error("malloc failed in run_tests");
+                eval_mm_counters(trace, mm_stats[i].counters);
+            }
+            if (frag_mode && !sparse_mode)
+            {
+                if (verbose > 1)
+                    printf("Breaking down the heap.\n");
+                mm_stats[i].frag = calloc(1, sizeof(frag_t));
+                if (mm_stats[i].frag == NULL)
+                    unix_error("calloc failed in run_tests");
+                eval_mm_frag(trace, mm_stats[i].frag);
+            }
+            if (steady_passes > 0 && !sparse_mode)
+            {
+                if (verbose > 1)
+                    printf("Replaying %d times on one heap.\n", steady_passes);
+                mm_stats[i].steady =
+                    calloc(1, sizeof(steady_t) +
+                                  steady_passes * sizeof(steady_pass_t));
+                if (mm_stats[i].steady == NULL)
+                    unix_error("calloc failed in run_tests");
+                eval_mm_steady(trace, mm_stats[i].steady);
+            }
         }
 
 #if 0
@@ -388,7 +547,7 @@ int main(int argc, char **argv)
     /*
      * Read and interpret the command line arguments
      */
-    while ((c = getopt(argc, argv, "d:f:c:s:t:v:hpCOVAlDT")) != EOF)
+    while ((c = getopt(argc, argv, "b:d:f:c:s:t:v:M:R:hpCOVAlDFLPTW")) != EOF)
     {
         switch (c)
         {
@@ -425,6 +584,10 @@ int main(int argc, char **argv)
             run_libc = true;
             break;
 
+        case 'b': /* Compare this allocator with the other -b ones */
+            add_backend(optarg);
+            break;
+
         case 'V': /* Increase verbosity level */
             verbose += 1;
             break;
@@ -449,6 +612,32 @@ int main(int argc, char **argv)
             tab_mode = true;
             break;
 
+        case 'L':
+            latency_mode = true;
+            break;
+
+        case 'P':
+            counter_mode = true;
+            break;
+
+        case 'F':
+            frag_mode = true;
+            break;
+
+        case 'W': /* Fault the heap in once, before anything is timed */
+            mem_set_prefault(true);
+            break;
+
+        case 'M': /* Memory for sparse emulation, in MB */
+            mem_set_sparse_limit((size_t)atol(optarg) << 20);
+            break;
+
+        case 'R':
+            steady_passes = atoi(optarg);
+            if (steady_passes < 1)
+                app_error("-R needs a positive number of passes\n");
+            break;
+
         case 'h': /* Print this message */
             usage(argv[0]);
             exit(0);
@@ -477,6 +666,29 @@ int main(int argc, char **argv)
         init_random_data();
     }
 
+    /* Comparing allocators replaces the usual run */
+    if (num_backends > 0)
+    {
+        if (sparse_mode)
+            app_error("-b needs real memory; it can't be used in sparse mode");
+        compare_backends(num_global_tracefiles, tracedir, global_tracefiles);
+        exit(0);
+    }
+
+    /* Carry on without counters if the kernel won't give us any */
+    if (counter_mode && perfctr_open() == 0)
+    {
+        fprintf(stderr, "perf_event_open: %s; ignoring -P\n", strerror(errno));
+        counter_mode = false;
+    }
+
+    /* The heap can only be broken down with the allocator's help */
+    if (frag_mode && mm_heapstats == NULL)
+    {
+        fprintf(stderr, "mm_heapstats is not available; ignoring -F\n");
+        frag_mode = false;
+    }
+
     /* Initialize the timeout */
     if (set_timeout > 0)
     {
@@ -505,7 +717,7 @@ int main(int argc, char **argv)
 
             if (verbose > 1)
                 printf("Checking libc malloc for correctness, ");
-            libc_stats[i].valid = eval_libc_valid(trace);
+            libc_stats[i].valid = eval_libc_valid(trace, &libc_backend);
             if (libc_stats[i].valid)
             {
                 speed_params.trace = trace;
@@ -806,9 +1018,11 @@ static bool add_range(range_set_t *ranges, char *lo, size_t size,
         return false;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
-        (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi()))
+    /* The payload must lie within the extent of the heap, or within one of
+       the allocator's own mappings */
+    if (((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
+         (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) &&
+        !mem_mapped(lo, size))
     {
         malloc_error(trace, opnum, "Payload (%p:%p) lies outside heap (%p:%p)",
                      lo, hi, mem_heap_lo(), mem_heap_hi());
@@ -1001,6 +1215,38 @@ static bool check_index(const trace_t *trace, int opnum, int index)
     return true;
 }
 
+/*
+ * check_calloc - check that mm_calloc zeroes a block big enough to get a
+ *     mapping of its own.  The mapping may take pages an earlier run left
+ *     dirty, and in sparse mode every byte must also read as initialized.
+ */
+static bool check_calloc(const trace_t *trace)
+{
+    uint64_t *p = mm_calloc(CALLOC_CHECK_BYTES / sizeof(*p), sizeof(*p));
+    size_t i;
+
+    if (p == NULL)
+    {
+        malloc_error(trace, 0, "mm_calloc of %d bytes failed.",
+                     CALLOC_CHECK_BYTES);
+        return false;
+    }
+    for (i = 0; i < CALLOC_CHECK_BYTES / sizeof(*p); i++)
+    {
+        if (mem_read(&p[i], sizeof(*p)) != 0)
+            break;
+    }
+    mm_free(p);
+    if (i < CALLOC_CHECK_BYTES / sizeof(*p))
+    {
+        malloc_error(trace, 0,
+                     "mm_calloc of %d bytes left a nonzero word at byte %zu",
+                     CALLOC_CHECK_BYTES, i * sizeof(*p));
+        return false;
+    }
+    return true;
+}
+
 /**********************************************
  * The following routines manipulate tracefiles
  *********************************************/
@@ -1011,14 +1257,7 @@ static bool check_index(const trace_t *trace, int opnum, int index)
 static trace_t *read_trace(stats_t *stats, const char *tracedir,
                            const char *filename)
 {
-    FILE *tracefile;
     trace_t *trace;
-    char type[MAXLINE];
-    int index;
-    size_t size;
-    int max_index = 0;
-    int op_index;
-    int ignore = 0;
 
     if (verbose > 1)
         printf("Reading tracefile: %s\n", filename);
@@ -1027,29 +1266,15 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     if ((trace = (trace_t *)malloc(sizeof(trace_t))) == NULL)
         unix_error("malloc 1 failed in read_trace");
 
-    /* Read the trace file header */
+    /* Load the requests, from a binary trace beside the text one if any */
     strcpy(trace->filename, tracedir);
     strcat(trace->filename, filename);
-    if ((tracefile = fopen(trace->filename, "r")) == NULL)
-    {
-        unix_error("Could not open %s in read_trace", trace->filename);
-    }
-    int iweight;
-    ignore += fscanf(tracefile, "%d", &iweight);
-    trace->weight = iweight;
-    ignore += fscanf(tracefile, "%d", &trace->num_ids);
-    ignore += fscanf(tracefile, "%d", &trace->num_ops);
-    ignore += fscanf(tracefile, "%zd", &trace->data_bytes);
-
-    if (trace->weight > 3)
-    {
-        app_error("%s: weight can only be in {0, 1, 2 3}", trace->filename);
-    }
-
-    /* We'll store each request line in the trace in this array */
-    if ((trace->ops =
-             (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
-        unix_error("malloc 2 failed in read_trace");
+    trace->file = trace_load(trace->filename, true);
+    trace->weight = trace->file->weight;
+    trace->num_ids = trace->file->num_ids;
+    trace->num_ops = trace->file->num_ops;
+    trace->data_bytes = trace->file->data_bytes;
+    trace->ops = trace->file->ops;
 
     /* We'll keep an array of pointers to the allocated blocks here... */
     if ((trace->blocks = (char **)calloc(trace->num_ids, sizeof(char *))) ==
@@ -1066,44 +1291,6 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
              calloc(trace->num_ids, sizeof(*trace->block_rand_base))) == NULL)
         unix_error("malloc 5 failed in read_trace");
 
-    /* read every request line in the trace file */
-    index = 0;
-    op_index = 0;
-    while (fscanf(tracefile, "%s", type) != EOF)
-    {
-        switch (type[0])
-        {
-        case 'a':
-            ignore += fscanf(tracefile, "%u %lu", &index, &size);
-            trace->ops[op_index].type = ALLOC;
-            trace->ops[op_index].index = index;
-            trace->ops[op_index].size = size;
-            max_index = (index > max_index) ? index : max_index;
-            break;
-        case 'r':
-            ignore += fscanf(tracefile, "%u %lu", &index, &size);
-            trace->ops[op_index].type = REALLOC;
-            trace->ops[op_index].index = index;
-            trace->ops[op_index].size = size;
-            max_index = (index > max_index) ? index : max_index;
-            break;
-        case 'f':
-            ignore += fscanf(tracefile, "%u", &index);
-            trace->ops[op_index].type = FREE;
-            trace->ops[op_index].index = index;
-            break;
-        default:
-            app_error("Bogus type character (%c) in tracefile %s\n", type[0],
-                      trace->filename);
-        }
-        op_index++;
-        if (op_index == trace->num_ops)
-            break;
-    }
-    fclose(tracefile);
-    assert(max_index == trace->num_ids - 1);
-    assert(trace->num_ops == op_index);
-
     /* fill in the stats */
     strcpy(stats->filename, trace->filename);
     stats->weight = trace->weight;
@@ -1123,15 +1310,15 @@ static void reinit_trace(trace_t *trace)
 }
 
 /*
- * free_trace - Free the trace record and the four arrays it points
- *              to, all of which were allocated in read_trace().
+ * free_trace - Free the trace record, the loaded trace file and the three
+ *              arrays it points to, all of which were set up in read_trace().
  */
 static void free_trace(trace_t *trace)
 {
-    free(trace->ops); /* free the three arrays... */
+    trace_close(trace->file); /* release the requests... */
     free(trace->blocks);
     free(trace->block_sizes);
-    free(trace->block_rand_base);
+    free(trace->block_rand_base); /* the three arrays... */
     free(trace); /* and the trace record itself... */
 }
 
@@ -1143,7 +1330,8 @@ static void free_trace(trace_t *trace)
 /*
  * eval_mm_valid - Check the mm malloc package for correctness
  */
-static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
+static bool eval_mm_valid(trace_t *trace, range_set_t *ranges,
+                          const backend_t *mm)
 {
     int i;
     int index;
@@ -1158,12 +1346,16 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
     reinit_trace(trace);
 
     /* Call the mm package's init function */
-    if (!mm_init())
+    if (!mm->init())
     {
-        malloc_error(trace, 0, "mm_init failed.");
+        malloc_error(trace, 0, "%s_init failed.", mm->name);
         return false;
     }
 
+    /* calloc isn't in the traces, so try it on its own */
+    if (mm == &mm_backend && !check_calloc(trace))
+        return false;
+
     /* Interpret each operation in the trace in order */
     for (i = 0; i < trace->num_ops; i++)
     {
@@ -1175,9 +1367,10 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
             range_t *r;
 
             /* Let the students check their own heap */
-            if (!mm_checkheap(0))
+            if (!mm->checkheap(0))
             {
-                malloc_error(trace, i, "mm_checkheap returned false\n");
+                malloc_error(trace, i, "%s_checkheap returned false\n",
+                             mm->name);
                 return false;
             };
 
@@ -1199,9 +1392,9 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
         case ALLOC: /* mm_malloc */
 
             /* Call the student's malloc */
-            if ((p = mm_malloc(size)) == NULL)
+            if ((p = mm->malloc(size)) == NULL)
             {
-                malloc_error(trace, i, "mm_malloc failed.");
+                malloc_error(trace, i, "%s_malloc failed.", mm->name);
                 return false;
             }
 
@@ -1230,18 +1423,19 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
             /* Call the student's realloc */
             oldp = trace->blocks[index];
             setUBCheck(false);
-            newp = mm_realloc(oldp, size);
+            newp = mm->realloc(oldp, size);
             setUBCheck(true);
             if ((newp == NULL) && (size != 0))
             {
-                malloc_error(trace, i, "mm_realloc failed.");
+                malloc_error(trace, i, "%s_realloc failed.", mm->name);
                 return false;
             }
             if ((newp != NULL) && (size == 0))
             {
                 malloc_error(trace, i,
-                             "mm_realloc with size 0 returned "
-                             "non-NULL.");
+                             "%s_realloc with size 0 returned "
+                             "non-NULL.",
+                             mm->name);
                 return false;
             }
 
@@ -1291,7 +1485,7 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
                 p = trace->blocks[index];
                 remove_range(ranges, p);
             }
-            mm_free(p);
+            mm->free(p);
             break;
 
         default:
@@ -1307,20 +1501,25 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
  *   The idea is to remember the high water mark "hwm" of the heap for
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the
- *   size of the heap in bytes after running the student's malloc
- *   package on the trace. Note that our implementation of mem_sbrk()
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap.
+ *   high water mark of the heap plus the package's mappings in bytes while
+ *   running the student's malloc package on the trace. mem_sbrk() lets the
+ *   package shrink the heap again, even within one request, so memlib keeps
+ *   the high water mark as the heap grows (mem_peak_heapsize).
  *
  *   A higher number is better: 1 is optimal.
+ *
+ *   Also records the peak heap size and the resident size of the heap at
+ *   the end of the trace in stats.
  */
-static double eval_mm_util(trace_t *trace, int tracenum)
+static double eval_mm_util(trace_t *trace, int tracenum, stats_t *stats,
+                           const backend_t *mm)
 {
     int i;
     int index;
     size_t size, newsize, oldsize;
     size_t max_total_size = 0;
     size_t total_size = 0;
+    size_t max_heap_size;
     char *p;
     char *newp, *oldp;
 
@@ -1328,8 +1527,9 @@ static double eval_mm_util(trace_t *trace, int tracenum)
 
     /* initialize the heap and the mm malloc package */
     mem_reset_brk();
-    if (!mm_init())
-        app_error("trace %d: mm_init failed in eval_mm_util", tracenum);
+    if (!mm->init())
+        app_error("trace %d: %s_init failed in eval_mm_util", tracenum,
+                  mm->name);
 
     for (i = 0; i < trace->num_ops; i++)
     {
@@ -1340,10 +1540,10 @@ static double eval_mm_util(trace_t *trace, int tracenum)
             index = trace->ops[i].index;
             size = trace->ops[i].size;
 
-            if ((p = mm_malloc(size)) == NULL)
+            if ((p = mm->malloc(size)) == NULL)
             {
-                app_error("trace %d: mm_malloc failed in eval_mm_util",
-                          tracenum);
+                app_error("trace %d: %s_malloc failed in eval_mm_util",
+                          tracenum, mm->name);
             }
 
             /* Remember region and size */
@@ -1360,10 +1560,10 @@ static double eval_mm_util(trace_t *trace, int tracenum)
 
             oldp = trace->blocks[index];
             setUBCheck(false);
-            if ((newp = mm_realloc(oldp, newsize)) == NULL && newsize != 0)
+            if ((newp = mm->realloc(oldp, newsize)) == NULL && newsize != 0)
             {
-                app_error("trace %d: mm_realloc failed in eval_mm_util",
-                          tracenum);
+                app_error("trace %d: %s_realloc failed in eval_mm_util",
+                          tracenum, mm->name);
             }
             setUBCheck(true);
 
@@ -1387,7 +1587,7 @@ static double eval_mm_util(trace_t *trace, int tracenum)
                 p = trace->blocks[index];
             }
 
-            mm_free(p);
+            mm->free(p);
 
             total_size -= size;
             break;
@@ -1397,60 +1597,74 @@ static double eval_mm_util(trace_t *trace, int tracenum)
                       tracenum);
         }
 
-        /* update the high-water mark */
+        /* update the high-water mark; memlib keeps the heap's */
         max_total_size =
             (total_size > max_total_size) ? total_size : max_total_size;
     }
+    max_heap_size = mem_peak_heapsize();
 
 #if !REF_ONLY
     printf(".");
 #endif
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    stats->heap_bytes = max_heap_size;
+    stats->rss_bytes = mem_resident();
+    return ((double)max_total_size / (double)max_heap_size);
 }
 
 /*
- * eval_mm_speed - This is the function that is used by fcyc()
- *    to measure the running time of the mm malloc package.
+ * replay_trace - Run every request of the trace through backend, as fast as
+ *    possible.  Always inlined, so that with one of the built-in backends
+ *    the compiler calls the allocator directly, exactly as if the loop had
+ *    been written for it; only eval_backend_speed pays for the indirection.
+ *    If counters is set, the hardware counters count the requests alone,
+ *    not the heap reset and init before them.
  */
-static void eval_mm_speed(void *ptr)
+static inline __attribute__((always_inline)) void
+replay_trace(trace_t *trace, const backend_t *backend,
+             perfctr_sample_t *counters)
 {
     int i, index;
     size_t size, newsize;
     char *p, *newp, *oldp, *block;
-    trace_t *trace = ((speed_t *)ptr)->trace;
     reinit_trace(trace);
 
-    /* Reset the heap and initialize the mm package */
-    mem_reset_brk();
-    if (!mm_init())
-        app_error("mm_init failed in eval_mm_speed");
+    /* Reset the heap and initialize the package */
+    if (backend->memlib)
+        mem_reset_brk();
+    if (backend->init != NULL && !backend->init())
+        app_error("%s_init failed in eval_speed", backend->name);
+    if (counters != NULL)
+        perfctr_start();
 
     /* Interpret each trace request */
     for (i = 0; i < trace->num_ops; i++)
         switch (trace->ops[i].type)
         {
 
-        case ALLOC: /* mm_malloc */
+        case ALLOC: /* malloc */
             index = trace->ops[i].index;
             size = trace->ops[i].size;
-            if ((p = mm_malloc(size)) == NULL)
-                app_error("mm_malloc error in eval_mm_speed");
+            if ((p = backend->malloc(size)) == NULL)
+                app_error("%s_malloc error in eval_speed", backend->name);
             trace->blocks[index] = p;
             break;
 
-        case REALLOC: /* mm_realloc */
+        case REALLOC: /* realloc */
             index = trace->ops[i].index;
             newsize = trace->ops[i].size;
             oldp = trace->blocks[index];
-            setUBCheck(false);
-            if ((newp = mm_realloc(oldp, newsize)) == NULL && newsize != 0)
-                app_error("mm_realloc error in eval_mm_speed");
-            setUBCheck(true);
+            if (backend->memlib)
+                setUBCheck(false);
+            if ((newp = backend->realloc(oldp, newsize)) == NULL &&
+                newsize != 0)
+                app_error("%s_realloc error in eval_speed", backend->name);
+            if (backend->memlib)
+                setUBCheck(true);
             trace->blocks[index] = newp;
             break;
 
-        case FREE: /* mm_free */
+        case FREE: /* free */
             index = trace->ops[i].index;
             if (index < 0)
             {
@@ -1460,27 +1674,334 @@ static void eval_mm_speed(void *ptr)
             {
                 block = trace->blocks[index];
             }
-            mm_free(block);
+            backend->free(block);
             break;
 
         default:
-            app_error("Nonexistent request type in eval_mm_speed");
+            app_error("Nonexistent request type in eval_speed");
         }
+
+    if (counters != NULL)
+        perfctr_stop(counters);
+}
+
+/*
+ * eval_mm_speed - This is the function that is used by fcyc()
+ *    to measure the running time of the mm malloc package.
+ */
+static void eval_mm_speed(void *ptr)
+{
+    replay_trace(((speed_t *)ptr)->trace, &mm_backend, NULL);
+}
+
+/*
+ * eval_mm_counters - Read the hardware counters over one replay of the
+ *    trace by the mm malloc package (-P)
+ */
+static void eval_mm_counters(trace_t *trace, perfctr_sample_t *counters)
+{
+    replay_trace(trace, &mm_backend, counters);
+}
+
+/*
+ * eval_backend_speed - This is the function that is used by fcyc() to
+ *    measure the running time of the backend in the speed_t.
+ */
+static void eval_backend_speed(void *ptr)
+{
+    speed_t *params = ptr;
+    replay_trace(params->trace, params->backend, NULL);
+}
+
+/*
+ * eval_mm_latency - Time every request of the trace on its own with a
+ *    cycle counter, and add the counts to one histogram per request type.
+ *    Short traces are replayed until LATENCY_MIN_SAMPLES requests have
+ *    been timed, so that the tail percentiles mean something.
+ */
+static void eval_mm_latency(trace_t *trace, latency_t *latency)
+{
+    struct timespec start, end;
+    uint64_t ticks_start, t0, t1;
+    long samples = 0;
+    char *p;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ticks_start = lathist_now();
+
+    do
+    {
+        reinit_trace(trace);
+        mem_reset_brk();
+        if (!mm_init())
+            app_error("mm_init failed in eval_mm_latency");
+
+        for (int i = 0; i < trace->num_ops; i++)
+        {
+            traceop_t *op = &trace->ops[i];
+
+            switch (op->type)
+            {
+            case ALLOC: /* mm_malloc */
+                t0 = lathist_now();
+                p = mm_malloc(op->size);
+                t1 = lathist_now();
+                if (p == NULL)
+                    app_error("mm_malloc error in eval_mm_latency");
+                trace->blocks[op->index] = p;
+                break;
+
+            case REALLOC: /* mm_realloc */
+                setUBCheck(false);
+                t0 = lathist_now();
+                p = mm_realloc(trace->blocks[op->index], op->size);
+                t1 = lathist_now();
+                setUBCheck(true);
+                if (p == NULL && op->size != 0)
+                    app_error("mm_realloc error in eval_mm_latency");
+                trace->blocks[op->index] = p;
+                break;
+
+            case FREE: /* mm_free */
+                p = op->index < 0 ? NULL : trace->blocks[op->index];
+                t0 = lathist_now();
+                mm_free(p);
+                t1 = lathist_now();
+                break;
+
+            default:
+                app_error("Nonexistent request type in eval_mm_latency");
+            }
+            lathist_record(&latency->hist[op->type], t1 - t0);
+        }
+        samples += trace->num_ops;
+    } while (trace->num_ops > 0 && samples < LATENCY_MIN_SAMPLES);
+
+    /* Calibrate the counter against the clock over the whole run */
+    uint64_t ticks = lathist_now() - ticks_start;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double ns = (double)(end.tv_sec - start.tv_sec) * 1e9 +
+                (double)(end.tv_nsec - start.tv_nsec);
+    latency->ns_per_tick = ticks > 0 ? ns / (double)ticks : 1.0;
+}
+
+/*
+ * block_need - The least a block for a payload of size bytes can take, with
+ *    the allocator's header size and alignment
+ */
+static size_t block_need(const mm_heapstats_t *hs, size_t size)
+{
+    size_t align = hs->alignment > 0 ? hs->alignment : 1;
+    return (size + hs->header_size + align - 1) / align * align;
+}
+
+/*
+ * eval_mm_frag - Replay the trace and break the heap down at FRAG_SAMPLES
+ *    evenly spaced requests.  mm_heapstats tells which bytes are in
+ *    allocated and in free blocks; the driver knows the payload of every
+ *    live block, and from the allocator's header size and alignment what
+ *    each block would take if it were no bigger than needed.  Whatever an
+ *    allocated block has beyond that is counted as slack.
+ */
+static void eval_mm_frag(trace_t *trace, frag_t *frag)
+{
+    mm_heapstats_t hs;
+    size_t payload = 0, header = 0, needed = 0;
+    int next = 0;
+    char *p;
+
+    reinit_trace(trace);
+    mem_reset_brk();
+    if (!mm_init() || !mm_heapstats(&hs))
+        app_error("mm_init failed in eval_mm_frag");
+
+    for (int i = 0; i < trace->num_ops; i++)
+    {
+        traceop_t *op = &trace->ops[i];
+        size_t oldsize = op->index < 0 ? 0 : trace->block_sizes[op->index];
+
+        switch (op->type)
+        {
+        case ALLOC: /* mm_malloc */
+            if ((p = mm_malloc(op->size)) == NULL)
+                app_error("mm_malloc error in eval_mm_frag");
+            trace->blocks[op->index] = p;
+            trace->block_sizes[op->index] = op->size;
+            payload += op->size;
+            header += hs.header_size;
+            needed += block_need(&hs, op->size);
+            break;
+
+        case REALLOC: /* mm_realloc */
+            setUBCheck(false);
+            p = mm_realloc(trace->blocks[op->index], op->size);
+            setUBCheck(true);
+            if (p == NULL && op->size != 0)
+                app_error("mm_realloc error in eval_mm_frag");
+            trace->blocks[op->index] = p;
+            trace->block_sizes[op->index] = op->size;
+            payload += op->size - oldsize;
+            needed += block_need(&hs, op->size) - block_need(&hs, oldsize);
+            if (p == NULL) /* realloc to 0 frees the block */
+            {
+                header -= hs.header_size;
+                needed -= block_need(&hs, 0);
+            }
+            break;
+
+        case FREE: /* mm_free */
+            if (op->index < 0)
+            {
+                mm_free(NULL);
+                break;
+            }
+            mm_free(trace->blocks[op->index]);
+            payload -= oldsize;
+            header -= hs.header_size;
+            needed -= block_need(&hs, oldsize);
+            break;
+
+        default:
+            app_error("Nonexistent request type in eval_mm_frag");
+        }
+
+        /* Sample after the last request of each stretch of the trace */
+        if ((long)(i + 1) * FRAG_SAMPLES <
+            (long)trace->num_ops * (next + 1))
+            continue;
+
+        frag_sample_t *sample = &frag->samples[next++];
+        size_t mapped = mem_mapsize();
+        size_t alloc;
+
+        mm_heapstats(&hs);
+        alloc = hs.alloc_bytes + mapped;
+        sample->op = i;
+        sample->heap = mem_heapsize() + mapped;
+        sample->payload = payload;
+        sample->header = header;
+        sample->padding = needed - payload - header;
+        sample->slack = alloc > needed ? alloc - needed : 0;
+        sample->free = hs.free_bytes;
+        sample->meta = sample->heap - alloc - sample->free;
+    }
+    frag->count = next;
+}
+
+/*
+ * eval_mm_steady - Replay the trace steady_passes times back to back on the
+ *    same heap, the way a long-running program would see it: the package is
+ *    initialized once, and between passes every block the trace left live
+ *    is freed, but the heap is never reset.  If the allocator keeps
+ *    fragmenting or leaking, the heap goes on growing from pass to pass.
+ *    Only the trace's requests are timed, with memlib tracking the peak heap
+ *    as they go; the freeing between passes is not.
+ */
+static void eval_mm_steady(trace_t *trace, steady_t *steady)
+{
+    struct timespec start, end;
+    char *p;
+
+    mem_reset_brk();
+    if (!mm_init())
+        app_error("mm_init failed in eval_mm_steady");
+
+    for (int pass = 0; pass < steady_passes; pass++)
+    {
+        steady_pass_t *sp = &steady->passes[pass];
+        size_t payload = 0;
+
+        reinit_trace(trace);
+        mem_reset_peak();
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < trace->num_ops; i++)
+        {
+            traceop_t *op = &trace->ops[i];
+            size_t oldsize =
+                op->index < 0 ? 0 : trace->block_sizes[op->index];
+
+            switch (op->type)
+            {
+            case ALLOC: /* mm_malloc */
+                if ((p = mm_malloc(op->size)) == NULL)
+                {
+                    steady->failed = true;
+                    return;
+                }
+                trace->blocks[op->index] = p;
+                trace->block_sizes[op->index] = op->size;
+                payload += op->size;
+                break;
+
+            case REALLOC: /* mm_realloc */
+                setUBCheck(false);
+                p = mm_realloc(trace->blocks[op->index], op->size);
+                setUBCheck(true);
+                if (p == NULL && op->size != 0)
+                {
+                    steady->failed = true;
+                    return;
+                }
+                trace->blocks[op->index] = p;
+                trace->block_sizes[op->index] = op->size;
+                payload += op->size - oldsize;
+                break;
+
+            case FREE: /* mm_free */
+                if (op->index < 0)
+                {
+                    mm_free(NULL);
+                    break;
+                }
+                mm_free(trace->blocks[op->index]);
+                trace->blocks[op->index] = NULL;
+                trace->block_sizes[op->index] = 0;
+                payload -= oldsize;
+                break;
+
+            default:
+                app_error("Nonexistent request type in eval_mm_steady");
+            }
+
+            if (payload > sp->peak_payload)
+                sp->peak_payload = payload;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        sp->peak_heap = mem_peak_heapsize();
+        sp->secs = (double)(end.tv_sec - start.tv_sec) +
+                   (double)(end.tv_nsec - start.tv_nsec) * 1e-9;
+
+        /* Free whatever the trace left behind before the next pass */
+        for (int id = 0; id < trace->num_ids; id++)
+        {
+            if (trace->blocks[id] != NULL)
+                mm_free(trace->blocks[id]);
+        }
+        sp->end_heap = mem_heapsize() + mem_mapsize();
+        steady->count++;
+    }
 }
 
 /*
  * eval_libc_valid - We run this function to make sure that the
- *    libc malloc can run to completion on the set of traces.
+ *    libc malloc, or another backend outside memlib, can run to
+ *    completion on the set of traces.
  *    We'll be conservative and terminate if any libc malloc call fails.
  *
  */
-static bool eval_libc_valid(trace_t *trace)
+static bool eval_libc_valid(trace_t *trace, const backend_t *libc)
 {
     int i;
     size_t newsize;
     char *p, *newp, *oldp;
 
     reinit_trace(trace);
+    if (libc->init != NULL && !libc->init())
+    {
+        malloc_error(trace, 0, "%s_init failed.", libc->name);
+        return false;
+    }
 
     for (i = 0; i < trace->num_ops; i++)
     {
@@ -1488,9 +2009,9 @@ static bool eval_libc_valid(trace_t *trace)
         {
 
         case ALLOC: /* malloc */
-            if ((p = malloc(trace->ops[i].size)) == NULL)
+            if ((p = libc->malloc(trace->ops[i].size)) == NULL)
             {
-                malloc_error(trace, i, "libc malloc failed");
+                malloc_error(trace, i, "%s malloc failed", libc->name);
                 unix_error("System message");
             }
             trace->blocks[trace->ops[i].index] = p;
@@ -1499,9 +2020,9 @@ static bool eval_libc_valid(trace_t *trace)
         case REALLOC: /* realloc */
             newsize = trace->ops[i].size;
             oldp = trace->blocks[trace->ops[i].index];
-            if ((newp = realloc(oldp, newsize)) == NULL && newsize != 0)
+            if ((newp = libc->realloc(oldp, newsize)) == NULL && newsize != 0)
             {
-                malloc_error(trace, i, "libc realloc failed");
+                malloc_error(trace, i, "%s realloc failed", libc->name);
                 unix_error("System message");
             }
             trace->blocks[trace->ops[i].index] = newp;
@@ -1510,11 +2031,11 @@ static bool eval_libc_valid(trace_t *trace)
         case FREE: /* free */
             if (trace->ops[i].index >= 0)
             {
-                free(trace->blocks[trace->ops[i].index]);
+                libc->free(trace->blocks[trace->ops[i].index]);
             }
             else
             {
-                free(0);
+                libc->free(0);
             }
             break;
 
@@ -1533,50 +2054,200 @@ static bool eval_libc_valid(trace_t *trace)
  */
 static void eval_libc_speed(void *ptr)
 {
-    int i;
-    int index;
-    size_t size, newsize;
-    char *p, *newp, *oldp, *block;
-    trace_t *trace = ((speed_t *)ptr)->trace;
+    replay_trace(((speed_t *)ptr)->trace, &libc_backend, NULL);
+}
 
-    reinit_trace(trace);
+/*************************************************************
+ * The following functions compare several allocators (-b)
+ ************************************************************/
 
-    for (i = 0; i < trace->num_ops; i++)
+/*
+ * add_backend - Add a built-in allocator, or one loaded from a shared
+ *     object, to the ones to compare.  A shared object is used through
+ *     its mm_init, mm_malloc, ... if it has them, and through malloc,
+ *     free and realloc otherwise.  It is loaded with RTLD_DEEPBIND, so that
+ *     an allocator built for LD_PRELOAD (like mm.so) calls its own malloc
+ *     and free internally rather than libc's.
+ */
+static void add_backend(const char *name)
+{
+    const backend_t *builtin[] = {&mm_backend, &naive_backend, &libc_backend};
+    const backend_t *found = NULL;
+
+    for (size_t i = 0; i < sizeof(builtin) / sizeof(builtin[0]); i++)
     {
-        switch (trace->ops[i].type)
+        if (strcmp(name, builtin[i]->name) == 0)
+            found = builtin[i];
+    }
+
+    if (found == NULL)
+    {
+        void *handle = dlopen(name, RTLD_NOW | RTLD_LOCAL | RTLD_DEEPBIND);
+        backend_t *loaded = calloc(1, sizeof(backend_t));
+        const char *prefix;
+
+        if (handle == NULL)
+            app_error("Could not load allocator %s: %s", name, dlerror());
+        if (loaded == NULL)
+            unix_error("calloc failed in add_backend");
+
+        prefix = dlsym(handle, "mm_malloc") != NULL ? "mm_" : "";
+        loaded->name = strrchr(name, '/') ? strrchr(name, '/') + 1 : name;
+        loaded->init = *prefix ? (bool (*)(void))dlsym(handle, "mm_init")
+                               : NULL;
+        loaded->checkheap = NULL;
+        loaded->memlib = false;
+
+        char sym[MAXLINE];
+        snprintf(sym, sizeof(sym), "%smalloc", prefix);
+        loaded->malloc = (void *(*)(size_t))dlsym(handle, sym);
+        snprintf(sym, sizeof(sym), "%sfree", prefix);
+        loaded->free = (void (*)(void *))dlsym(handle, sym);
+        snprintf(sym, sizeof(sym), "%srealloc", prefix);
+        loaded->realloc = (void *(*)(void *, size_t))dlsym(handle, sym);
+        if (!loaded->malloc || !loaded->free || !loaded->realloc)
+            app_error("%s has no %smalloc, %sfree and %srealloc", name,
+                      prefix, prefix, prefix);
+        found = loaded;
+    }
+
+    backends = realloc(backends, (num_backends + 1) * sizeof(backend_t *));
+    if (backends == NULL)
+        unix_error("realloc failed in add_backend");
+    backends[num_backends++] = found;
+}
+
+/*
+ * compare_backends - Run every trace through every allocator given with
+ *     -b, and print one table of their throughput and utilization.  Each
+ *     trace is loaded once and shared by all of them.  Utilization is only
+ *     known for the allocators whose heap lives in memlib.
+ */
+static void compare_backends(int num_tracefiles, const char *tracedir,
+                             char **tracefiles)
+{
+    stats_t *stats = calloc((size_t)num_backends * num_tracefiles,
+                            sizeof(stats_t));
+    speed_t speed_params;
+
+    if (stats == NULL)
+        unix_error("calloc failed in compare_backends");
+
+    /* stats[b * num_tracefiles + i] is backend b on trace i */
+    for (int i = 0; i < num_tracefiles; i++)
+    {
+        mem_init(sparse_mode);
+        trace_t *trace = read_trace(&stats[i], tracedir, tracefiles[i]);
+
+        for (int b = 0; b < num_backends; b++)
         {
-        case ALLOC: /* malloc */
-            index = trace->ops[i].index;
-            size = trace->ops[i].size;
-            if ((p = malloc(size)) == NULL)
-                unix_error("malloc failed in eval_libc_speed");
-            trace->blocks[index] = p;
-            break;
+            const backend_t *backend = backends[b];
+            stats_t *st = &stats[b * num_tracefiles + i];
 
-        case REALLOC: /* realloc */
-            index = trace->ops[i].index;
-            newsize = trace->ops[i].size;
-            oldp = trace->blocks[index];
-            if ((newp = realloc(oldp, newsize)) == NULL && newsize != 0)
-                unix_error("realloc failed in eval_libc_speed\n");
+            *st = stats[i];
+            if (backend->memlib)
+            {
+                range_set_t *ranges = new_range_set();
+                st->valid = eval_mm_valid(trace, ranges, backend);
+                free_range_set(ranges);
+                if (st->valid)
+                    st->util = eval_mm_util(trace, i, st, backend);
+            }
+            else
+            {
+                st->valid = eval_libc_valid(trace, backend);
+            }
 
-            trace->blocks[index] = newp;
-            break;
+            if (st->valid)
+            {
+                speed_params.trace = trace;
+                speed_params.backend = backend;
+                st->secs = fsec(eval_backend_speed, &speed_params);
+                st->tput = st->ops / (st->secs * 1000.0);
+            }
+        }
+        free_trace(trace);
+        mem_deinit();
+    }
 
-        case FREE: /* free */
-            index = trace->ops[i].index;
-            if (index >= 0)
+    /* One row per trace, one pair of columns per allocator */
+    printf("\n%s", tab_mode ? "" : "    ");
+    for (int b = 0; b < num_backends; b++)
+        printf(tab_mode ? "%s Kops/s\t%s util\t" : " %16.16s", backends[b]->name,
+               backends[b]->name);
+    printf(tab_mode ? "trace\n" : "\n    ");
+    for (int b = 0; !tab_mode && b < num_backends; b++)
+        printf(" %8s %7s", "Kops/s", "util");
+    if (!tab_mode)
+        printf("  trace\n");
+
+    for (int i = 0; i <= num_tracefiles; i++)
+    {
+        printf(tab_mode ? "" : "    ");
+        for (int b = 0; b < num_backends; b++)
+        {
+            const stats_t *st = &stats[b * num_tracefiles];
+            double kops, util;
+
+            if (i < num_tracefiles)
             {
-                block = trace->blocks[index];
-                free(block);
+                if (!st[i].valid)
+                {
+                    printf(tab_mode ? "\t\t" : " %8s %7s", "-", "-");
+                    continue;
+                }
+                kops = st[i].tput;
+                util = backends[b]->memlib ? st[i].util : -1;
             }
             else
             {
-                free(0);
+                /* Summary: like the perf index, a harmonic mean of the
+                 * throughput and a plain mean of the utilization */
+                double inv_tput = 0, sum_util = 0;
+                int perf_weight = 0, util_weight = 0;
+                bool all_valid = true;
+
+                for (int j = 0; j < num_tracefiles; j++)
+                {
+                    all_valid = all_valid && st[j].valid;
+                    if (st[j].weight == WALL || st[j].weight == WPERF)
+                    {
+                        inv_tput += 1.0 / st[j].tput;
+                        perf_weight++;
+                    }
+                    if (st[j].weight == WALL || st[j].weight == WUTIL)
+                    {
+                        sum_util += st[j].util;
+                        util_weight++;
+                    }
+                }
+                if (!all_valid)
+                {
+                    printf(tab_mode ? "\t\t" : " %8s %7s", "-", "-");
+                    continue;
+                }
+                kops = perf_weight > 0 ? perf_weight / inv_tput : 0;
+                util = backends[b]->memlib && util_weight > 0
+                           ? sum_util / util_weight
+                           : -1;
             }
-            break;
+
+            if (kops == 0 && util < 0)
+                printf(tab_mode ? "\t\t" : " %8s %7s", "--", "--");
+            else if (kops == 0 && tab_mode)
+                printf("\t%.1f\t", util * 100.0);
+            else if (kops == 0)
+                printf(" %8s %6.1f%%", "--", util * 100.0);
+            else if (util < 0)
+                printf(tab_mode ? "%.0f\t\t" : " %8.0f %7s", kops, "--");
+            else
+                printf(tab_mode ? "%.0f\t%.1f\t" : " %8.0f %6.1f%%", kops,
+                       util * 100.0);
         }
+        printf(tab_mode ? "%s\n" : "  %s\n",
+               i < num_tracefiles ? stats[i].filename : "average");
     }
+    free(stats);
 }
 
 /*************************************
@@ -1605,12 +2276,13 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
     /* Print the individual results for each trace */
     if (tab_mode)
     {
-        printf("valid\tthru?\tutil?\tutil\tops\tmsecs\tKops/s\ttrace\n");
+        printf("valid\tthru?\tutil?\tutil\theapKB\trssKB\tops\tmsecs\tKops/s"
+               "\ttrace\n");
     }
     else
     {
-        printf("  %5s  %6s %7s%8s%8s  %s\n", "valid", "util", "ops", "msecs",
-               "Kops/s", "trace");
+        printf("  %5s  %6s %8s %8s %7s%8s%8s  %s\n", "valid", "util", "heapKB",
+               "rssKB", "ops", "msecs", "Kops/s", "trace");
     }
     for (i = 0; i < n; i++)
     {
@@ -1666,6 +2338,22 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
                     printf(" %8s", "--");
             }
 
+            /* Virtual and resident heap size */
+            if (tab_mode)
+            {
+                printf("%zu\t%zu\t", stats[i].heap_bytes / 1024,
+                       stats[i].rss_bytes / 1024);
+            }
+            else if (stats[i].heap_bytes != 0)
+            {
+                printf(" %8zu %8zu", stats[i].heap_bytes / 1024,
+                       stats[i].rss_bytes / 1024);
+            }
+            else
+            {
+                printf(" %8s %8s", "--", "--");
+            }
+
             /* Ops + Time */
             double msecs = sparse_mode ? 0.0 : stats[i].secs * 1000.0;
             double kops = sparse_mode ? 0.0 : stats[i].tput;
@@ -1702,13 +2390,13 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
         {
             if (tab_mode)
             {
-                printf("no\t\t\t\t\t\t\t%s\n", stats[i].filename);
+                printf("no\t\t\t\t\t\t\t\t\t%s\n", stats[i].filename);
             }
             else
             {
-                printf("%2s%4s%7s%10s%7s%10s %s\n",
+                printf("%2s%4s%7s%9s%9s%10s%10s%7s %s\n",
                        stats[i].weight != 0 ? "*" : "", "no", "-", "-", "-",
-                       "-", stats[i].filename);
+                       "-", "-", "-", stats[i].filename);
             }
         }
     }
@@ -1727,15 +2415,17 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
             sumsecs = 0;
         if (tab_mode)
         {
-            // "valid\tthru?\tutil?\tutil\tops\tmsecs\tKops\ttrace"
-            printf("Sum\t%d\t%d\t%.1f\t%.0f\t\%.2f\n", sum_perf_weight,
+            // "valid\tthru?\tutil?\tutil\theapKB\trssKB\tops\tmsecs\tKops\t"
+            // "trace"
+            printf("Sum\t%d\t%d\t%.1f\t\t\t%.0f\t\%.2f\n", sum_perf_weight,
                    sum_util_weight, sumutil * 100.0, sumops, sumsecs * 1000.0);
             printf("Avg\t\t\t%.1f\t\t\t\n", util * 100.0);
         }
         else
         {
-            printf("%2d %2d  %7.1f%%%8.0f%10.3f\n", sum_util_weight,
-                   sum_perf_weight, util * 100.0, sumops, sumsecs * 1000.0);
+            printf("%2d %2d  %7.1f%%%18s%8.0f%10.3f\n", sum_util_weight,
+                   sum_perf_weight, util * 100.0, "", sumops,
+                   sumsecs * 1000.0);
         }
 
         /* Record the summary statistics so we can compare libc and
@@ -1749,7 +2439,7 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
     {
         if (!tab_mode)
         {
-            printf("     %8s%10s%7s\n", "-", "-", "-");
+            printf("     %26s%10s%7s\n", "-", "-", "-");
         }
 
         /* Record the summary statistics so we can compare libc and
@@ -1759,6 +2449,241 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
         sumstats->secs = 0;
         sumstats->tput = 0;
     }
+
+    if (latency_mode)
+        printlatency(n, stats);
+    if (counter_mode)
+        printcounters(n, stats);
+    if (frag_mode)
+        printfrag(n, stats);
+    if (steady_passes > 0)
+        printsteady(n, stats);
+}
+
+/*
+ * printlatency - Print the latency percentiles of each request type, for
+ *     every trace that was timed with -L and for all of them together
+ */
+static void printlatency(int n, stats_t *stats)
+{
+    static const char *opnames[] = {"malloc", "free", "realloc"};
+    static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    const int nquantiles = sizeof(quantiles) / sizeof(quantiles[0]);
+    latency_t *all;
+    int timed = 0;
+
+    if ((all = calloc(1, sizeof(latency_t))) == NULL)
+        unix_error("calloc failed in printlatency");
+
+    if (tab_mode)
+        printf("\nop\tcount\tp50\tp90\tp99\tp99.9\tmax\ttrace\n");
+    else
+        printf("\nLatency per request (ns):\n  %-8s %9s %7s %7s %7s %7s %9s  "
+               "%s\n",
+               "op", "count", "p50", "p90", "p99", "p99.9", "max", "trace");
+
+    /* One row per request type per trace, then the same over all traces */
+    for (int i = 0; i <= n; i++)
+    {
+        latency_t *latency = i < n ? stats[i].latency : all;
+        const char *name = i < n ? stats[i].filename : "all traces";
+
+        if (i < n && (latency == NULL || !stats[i].valid))
+            continue;
+        if (i == n)
+        {
+            if (timed == 0)
+                break;
+            all->ns_per_tick /= timed;
+        }
+
+        for (int type = 0; type < 3; type++)
+        {
+            const lathist_t *h = &latency->hist[type];
+            double scale = latency->ns_per_tick;
+
+            if (i < n)
+                lathist_merge(&all->hist[type], h);
+            if (h->count == 0)
+                continue;
+
+            printf(tab_mode ? "%s\t%lu" : "  %-8s %9lu", opnames[type],
+                   (unsigned long)h->count);
+            for (int q = 0; q < nquantiles; q++)
+                printf(tab_mode ? "\t%.0f" : " %7.0f",
+                       (double)lathist_quantile(h, quantiles[q]) * scale);
+            printf(tab_mode ? "\t%.0f\t%s\n" : " %9.0f  %s\n",
+                   (double)h->max * scale, name);
+        }
+        if (i < n)
+        {
+            all->ns_per_tick += latency->ns_per_tick;
+            timed++;
+        }
+    }
+    free(all);
+}
+
+/*
+ * printcounters - Print the hardware counts per request of every trace
+ *     read with -P, and over all of those traces together.  Counters that
+ *     were unavailable are shown as '--'.
+ */
+static void printcounters(int n, stats_t *stats)
+{
+    double total[PERFCTR_COUNT] = {0};
+    double total_ops[PERFCTR_COUNT] = {0};
+
+    printf(tab_mode ? "\n" : "\nHardware counters per request:\n ");
+    for (int c = 0; c < PERFCTR_COUNT; c++)
+        printf(tab_mode ? "%s\t" : " %9s", perfctr_names[c]);
+    printf(tab_mode ? "trace\n" : "  trace\n");
+
+    for (int i = 0; i <= n; i++)
+    {
+        const double *count = i < n && stats[i].counters != NULL
+                                  ? stats[i].counters->count
+                                  : total;
+
+        if (i < n && (stats[i].counters == NULL || !stats[i].valid))
+            continue;
+
+        if (!tab_mode)
+            printf(" ");
+        for (int c = 0; c < PERFCTR_COUNT; c++)
+        {
+            double ops = i < n ? stats[i].ops : total_ops[c];
+
+            if (count[c] < 0 || ops == 0)
+            {
+                printf(tab_mode ? "\t" : " %9s", "--");
+                continue;
+            }
+            printf(tab_mode ? "%.3f\t" : " %9.3f", count[c] / ops);
+            if (i < n)
+            {
+                total[c] += count[c];
+                total_ops[c] += ops;
+            }
+        }
+        printf(tab_mode ? "%s\n" : "  %s\n", i < n ? stats[i].filename
+                                                  : "all traces");
+    }
+}
+
+/*
+ * printfrag - Print the heap breakdowns taken with -F, one row per sample
+ */
+static void printfrag(int n, stats_t *stats)
+{
+    static const char *const header[] = {"op", "heap", "payload", "header",
+                                         "padding", "slack", "free", "meta"};
+
+    if (tab_mode)
+    {
+        printf("\n");
+        for (size_t c = 0; c < sizeof(header) / sizeof(header[0]); c++)
+            printf("%s\t", header[c]);
+        printf("util\ttrace\n");
+    }
+    else
+        printf("\nHeap breakdown over each trace (bytes):\n");
+
+    for (int i = 0; i < n; i++)
+    {
+        const frag_t *frag = stats[i].frag;
+
+        if (frag == NULL || !stats[i].valid)
+            continue;
+        if (!tab_mode)
+        {
+            printf("  %s\n  ", stats[i].filename);
+            for (size_t c = 0; c < sizeof(header) / sizeof(header[0]); c++)
+                printf(" %10s", header[c]);
+            printf("   util\n");
+        }
+
+        for (int k = 0; k < frag->count; k++)
+        {
+            const frag_sample_t *s = &frag->samples[k];
+            const size_t values[] = {s->heap,  s->payload, s->header,
+                                     s->padding, s->slack, s->free, s->meta};
+            double util = s->heap > 0 ? 100.0 * (double)s->payload /
+                                            (double)s->heap
+                                      : 0;
+
+            printf(tab_mode ? "%d" : "   %10d", s->op);
+            for (size_t c = 0; c < sizeof(values) / sizeof(values[0]); c++)
+                printf(tab_mode ? "\t%zu" : " %10zu", values[c]);
+            if (tab_mode)
+                printf("\t%.1f\t%s\n", util, stats[i].filename);
+            else
+                printf(" %5.1f%%\n", util);
+        }
+    }
+}
+
+/*
+ * printsteady - Print every pass of the steady-state runs taken with -R,
+ *     and how much the last pass differs from the first
+ */
+static void printsteady(int n, stats_t *stats)
+{
+    if (tab_mode)
+        printf("\npass\tKops\tpeak_heap\tgrowth\tend_heap\tutil\ttrace\n");
+    else
+        printf("\nSteady-state replay on one heap:\n");
+
+    for (int i = 0; i < n; i++)
+    {
+        const steady_t *steady = stats[i].steady;
+
+        if (steady == NULL || !stats[i].valid)
+            continue;
+        if (!tab_mode)
+            printf("  %s\n  %8s %10s %12s %12s %12s %7s\n", stats[i].filename,
+                   "pass", "Kops", "peak heap", "growth", "end heap", "util");
+
+        for (int k = 0; k < steady->count; k++)
+        {
+            const steady_pass_t *sp = &steady->passes[k];
+            double kops = sp->secs > 0 ? stats[i].ops / (sp->secs * 1000.0)
+                                       : 0;
+            long growth = k > 0 ? (long)sp->peak_heap -
+                                      (long)steady->passes[k - 1].peak_heap
+                                : 0;
+            double util = sp->peak_heap > 0 ? 100.0 *
+                                                  (double)sp->peak_payload /
+                                                  (double)sp->peak_heap
+                                            : 0;
+
+            if (tab_mode)
+                printf("%d\t%.0f\t%zu\t%ld\t%zu\t%.1f\t%s\n", k + 1, kops,
+                       sp->peak_heap, growth, sp->end_heap, util,
+                       stats[i].filename);
+            else
+                printf("  %8d %10.0f %12zu %12ld %12zu %6.1f%%\n", k + 1, kops,
+                       sp->peak_heap, growth, sp->end_heap, util);
+        }
+
+        if (tab_mode)
+            continue;
+        if (steady->failed)
+            printf("  out of memory in pass %d\n", steady->count + 1);
+        else if (steady->count > 1)
+        {
+            const steady_pass_t *first = &steady->passes[0];
+            const steady_pass_t *last = &steady->passes[steady->count - 1];
+
+            printf("  pass %d against pass 1: peak heap %+.1f%%, "
+                   "throughput %+.1f%%\n",
+                   steady->count,
+                   100.0 * ((double)last->peak_heap /
+                                (double)first->peak_heap -
+                            1.0),
+                   100.0 * (first->secs / last->secs - 1.0));
+        }
+    }
 }
 
 /*
@@ -2013,7 +2938,10 @@ static double measure_ref_throughput(bool checkpoint)
  */
 static void usage(char *prog)
 {
-    fprintf(stderr, "Usage: %s [-hlVCdD] [-f <file>]\n", prog);
+    fprintf(stderr,
+            "Usage: %s [-hlVCdDFLPW] [-M <MB>] [-R <n>] [-f <file>] "
+            "[-b <alloc>]...\n",
+            prog);
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-C         Calculate Checkpoint Score.\n");
     fprintf(stderr, "\t-d <i>     Debug: 0 off; 1 default; 2 lots.\n");
@@ -2027,5 +2955,16 @@ static void usage(char *prog)
     fprintf(stderr, "\t-v <i>     Set Verbosity Level to <i>\n");
     fprintf(stderr, "\t-s <s>     Timeout after s secs (default no timeout)\n");
     fprintf(stderr, "\t-T         Print diagnostics in tab mode\n");
+    fprintf(stderr, "\t-L         Report per-request latency percentiles\n");
+    fprintf(stderr, "\t-P         Report hardware counters per request\n");
+    fprintf(stderr, "\t-F         Break the heap down over each trace\n");
+    fprintf(stderr, "\t-R <n>     Replay each trace n times on one heap\n");
+    fprintf(stderr, "\t-M <MB>    Let sparse emulation use up to <MB> MB\n");
+    fprintf(stderr, "\t-W         Keep the heap resident, so that timings "
+                    "take no page faults\n");
+    fprintf(stderr, "\t-b <alloc> Compare allocators instead: mm, naive, "
+                    "libc\n");
+    fprintf(stderr, "\t           or the path of a shared object (repeat "
+                    "-b for each)\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file\n");
 }
@@ -4,14 +4,25 @@
  *
  * This file allows compiling student malloc implementations so that they can
  * be used as an interpositioning library, and thereby run actual programs.
+ *
+ * The heap is a private span of address space, reserved on first use, rather
+ * than the program break: whatever else the process runs (the libc malloc
+ * of mdriver, when it loads mm.so with -b) may move the break as well.
  */
+#define _GNU_SOURCE // for mremap
+
 #include <assert.h>
+#include <errno.h>
 #include <stdint.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
 #include "config.h"
 #include "memlib.h"
 
+/* Address space reserved for the heap; pages are only backed once used */
+#define HEAP_RESERVE ((size_t)1 << 36)
+
 /* private global variables */
 static bool init = false;
 static unsigned char *heap;         /* Starting address of heap */
@@ -19,21 +30,28 @@ static unsigned char *mem_brk;      /* Current position of break */
 
 static void ensure_init(void) {
     if (!init) {
-        mem_brk = heap = sbrk(0);
-        assert(mem_brk != (void *)-1);
+        heap = mmap(NULL, HEAP_RESERVE, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        assert(heap != MAP_FAILED);
+        mem_brk = heap;
         init = true;
     }
 }
 
+/* A negative incr hands the top of the heap back to the OS */
 void *mem_sbrk(intptr_t incr) {
     ensure_init();
 
-    unsigned char *res = sbrk(incr);
-    if (res == (void *)-1) {
-        return res;
+    unsigned char *res = mem_brk;
+    if (incr > 0 && (size_t)incr > HEAP_RESERVE - (size_t)(mem_brk - heap)) {
+        errno = ENOMEM;
+        return (void *)-1;
+    }
+    if (incr < 0) {
+        assert((size_t)-incr <= (size_t)(mem_brk - heap));
+        mem_discard(mem_brk + incr, (size_t)-incr);
     }
 
-    assert(res == mem_brk);
     mem_brk += incr;
     return (void *) res;
 }
@@ -56,3 +74,51 @@ size_t mem_heapsize(void) {
 size_t mem_pagesize(void) {
     return (size_t)getpagesize();
 }
+
+void mem_discard(void *start, size_t len) {
+    size_t psize = mem_pagesize();
+    uintptr_t lo = ((uintptr_t)start + psize - 1) & ~(psize - 1);
+    uintptr_t hi = ((uintptr_t)start + len) & ~(psize - 1);
+
+    if (hi > lo) {
+        madvise((void *)lo, hi - lo, MADV_DONTNEED);
+    }
+}
+
+size_t mem_resident(void) {
+    ensure_init();
+
+    size_t psize = mem_pagesize();
+    uintptr_t lo = (uintptr_t)heap & ~(psize - 1);
+    unsigned char vec[1024];
+    size_t resident = 0;
+    while (lo < (uintptr_t)mem_brk) {
+        size_t len = (uintptr_t)mem_brk - lo;
+        if (len > sizeof(vec) * psize) {
+            len = sizeof(vec) * psize;
+        }
+        if (mincore((void *)lo, len, vec) != 0) {
+            return 0;
+        }
+        for (size_t i = 0; i < (len + psize - 1) / psize; i++) {
+            resident += vec[i] & 1;
+        }
+        lo += len;
+    }
+    return resident * psize;
+}
+
+void *mem_map(size_t len) {
+    void *start = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return (start == MAP_FAILED) ? NULL : start;
+}
+
+void mem_unmap(void *start, size_t len) {
+    munmap(start, len);
+}
+
+void *mem_remap(void *start, size_t old_len, size_t new_len) {
+    void *new_start = mremap(start, old_len, new_len, MREMAP_MAYMOVE);
+    return (new_start == MAP_FAILED) ? NULL : new_start;
+}
@@ -31,10 +31,24 @@
  *  in non-emulation, as it was to the same page as actual heap data.  But
  *  sparse emulation has tighter checks.  Commonly, the CPU reports a
  *  BUS ERROR on these accesses, and should be debugged as segmentation faults.
+ *
+ * Besides the heap, the allocator can ask for mappings of its own with
+ *  mem_map.  In dense mode these are real anonymous mmaps.  In sparse mode
+ *  they are carved out of a window of emulated addresses above the heap,
+ *  and emulated page by page just like the heap; each mapping keeps a list
+ *  of its pages, so unmapping it hands them back and mem_remap can move
+ *  them to a new address without copying any bytes.
+ *
+ * Sparse pages are mapped in slabs as they are first touched, and the hash
+ *  table doubles whenever the pages outnumber HASH_LOAD times its buckets
+ *  (half of them, by default), so neither costs more than the heap needs.
+ *  All of it together may not grow past the limit set with
+ *  mem_set_sparse_limit, by default the dense heap size.
  */
+#define _GNU_SOURCE /* for mremap */
+
 #include <assert.h>
 #include <errno.h>
-#include <fcntl.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -51,36 +65,104 @@
 void markGlobalsUninit(void);
 #endif
 
+/* The sanitizers only see copies made through libc's memcpy and memset */
+#if defined(__SSE2__) && !defined(USE_ASAN) && !defined(USE_MSAN)
+#include <emmintrin.h>
+#define USE_STREAMING 1
+#endif
+
 #include "config.h"
 #include "memlib.h"
 
+/*
+ * Copies and fills at least this large bypass the cache with non-temporal
+ * stores in dense mode: the destination is unlikely to be read again before
+ * it would have been evicted, and the data it displaces is.
+ */
+#define STREAM_MIN_BYTES (1 << 20)
+
+/* Number of entries in the sparse page lookup cache, a power of two */
+#define TLB_ENTRIES 256
+
+/*
+ * Sparse pages are mapped in slabs of this many bytes as the heap grows: a
+ * multiple of the huge page size, so that the kernel can back them with
+ * huge pages, as it did the single pool they replace
+ */
+#define SLAB_BYTES (4UL << 20)
+
+/* Number of buckets the sparse page table starts with, a power of two */
+#define MIN_BUCKETS 4096
+
 /* Data structure used to implement pages in sparse memory emulation */
 typedef struct MBLK
 {
     size_t id;         /* Page ID.  Counts number of pages from start of heap */
-    struct MBLK *next; /* Link for hash table */
-    unsigned char initSet[SPARSE_PAGE_SIZE / 8];
+    struct MBLK *next; /* Link for hash table, or for the free page list */
+    struct MBLK *map_next; /* Next page of the same mapping */
+    uint64_t initSet[SPARSE_PAGE_SIZE / 64]; /* Bytes written, one bit each */
     unsigned char bytes[SPARSE_PAGE_SIZE]; /* Page contents */
 } mem_block_t;
 
+/* A batch of sparse pages, mapped in one go */
+typedef struct SLAB
+{
+    struct SLAB *next;     /* Next slab, in the order they were mapped */
+    mem_block_t pages[];   /* SLAB_PAGES of them, then some padding */
+} page_slab_t;
+
+/* Pages in each slab.  mem_read reads 8 bytes even from the last byte of a
+ * page, hence the padding. */
+#define SLAB_PAGES                                                             \
+    ((SLAB_BYTES - sizeof(page_slab_t) - sizeof(uint64_t)) /                   \
+     sizeof(mem_block_t))
+
+/* An entry of the page lookup cache: the page last used with some ID */
+typedef struct
+{
+    size_t id;          /* Page ID, only meaningful if block is set */
+    mem_block_t *block; /* The page, or NULL if the entry is empty */
+} tlb_entry_t;
+
+/* A mapping made with mem_map */
+typedef struct MMAP
+{
+    unsigned char *start; /* First byte, page aligned */
+    size_t len;           /* Length in bytes, a multiple of the page size */
+    mem_block_t *pages;   /* Emulated pages of the mapping (sparse only) */
+    struct MMAP *next;    /* Next mapping, in address order */
+} mem_map_t;
+
 /* private global variables */
 static bool sparse = false;         /* Use sparse memory emulation */
 static unsigned char *heap;         /* Starting address of heap */
 static unsigned char *mem_brk;      /* Current position of break */
+static size_t peak_bytes = 0;       /* Most heap plus mappings at once */
+static size_t real_brk_bytes = 0;   /* Real break space taken so far */
 static unsigned char *mem_max_addr; /* Maximum allowable heap address */
-static size_t mmap_length =
-    MAX_DENSE_HEAP; /* Number of bytes allocated by mmap */
+static unsigned char *dense_heap = NULL; /* Dense heap, mapped only once */
+static bool prefault = false;    /* Keep the dense heap and mappings resident */
 static bool show_stats =
     false; /* Should program print allocation information? */
 static bool stats_printed =
     false; /* Has information been printed about allocation */
 
 /* Sparse memory representation */
-static mem_block_t *next_free_page = NULL; /* Next free page */
+static size_t sparse_limit = MAX_DENSE_HEAP; /* Bytes the pages may take */
+static page_slab_t *slabs = NULL;          /* All slabs of pages */
+static page_slab_t *cur_slab = NULL;       /* Slab new pages come from */
+static size_t cur_slab_used = 0;           /* Pages taken from cur_slab */
 static size_t num_pages = 0;               /* Total number of pages */
 static size_t num_free_pages = 0;          /* Number of free pages */
+static mem_block_t *free_pages = NULL; /* Pages given back by mem_unmap */
 static mem_block_t **page_table = NULL;    /* Hash table from page ID to page */
-static size_t num_buckets = 0;             /* Number of buckets in page table */
+static size_t num_buckets = 0;             /* Number of buckets, a power of 2 */
+static int bucket_shift = 64;              /* 64 - log2(num_buckets) */
+static tlb_entry_t tlb[TLB_ENTRIES];       /* Recently used pages, by ID */
+
+/* Mappings */
+static mem_map_t *maps = NULL; /* Live mappings, in address order */
+static size_t map_bytes = 0;   /* Total length of the live mappings */
 
 #ifdef NO_CHECK_UB
 static const bool checkUB = false;
@@ -112,8 +194,24 @@ const char *__msan_default_options()
  */
 static size_t page_id(const void *addr);
 static void *page_start(size_t id);
+static size_t page_span(const void *addr, size_t len);
 static void *get_mem(const void *addr, size_t, bool);
 static void print_stats();
+static bool emulated(const void *addr, size_t len);
+static mem_map_t *find_map(const void *addr);
+static void unmap_all(void);
+static void note_peak(void);
+static bool take_real_brk(size_t bytes);
+static void release_pages(mem_map_t *map, size_t keep);
+static void move_pages(mem_map_t *map, unsigned char *start);
+static unsigned char *place_map(size_t len);
+static void insert_map(mem_map_t *map);
+static size_t resident_pages(unsigned char *lo, unsigned char *hi);
+static void resize_page_table(size_t buckets);
+static mem_block_t *new_page(void);
+static size_t page_hash(size_t id);
+static void reset_pages(void);
+static void release_slabs(void);
 
 /*
  * mem_init - initialize the memory system model
@@ -129,50 +227,67 @@ void mem_init(bool do_sparse)
          * page table */
         double fbytes_per_page =
             sizeof(mem_block_t) + sizeof(mem_block_t *) / HASH_LOAD;
-        num_pages = (size_t)(MAX_DENSE_HEAP / fbytes_per_page);
-        num_buckets = num_pages / HASH_LOAD;
-        mmap_length = num_buckets * sizeof(mem_block_t *) + // Page table
-                      num_pages * sizeof(mem_block_t) +     // Pages
-                      sizeof(uint64_t);                     // Padding
-        setUBCheck(true);
-    }
-    else
-    {
-        /* Dense allocation */
-        next_free_page = NULL;
-        num_pages = 0;
-        page_table = NULL;
-        num_buckets = 0;
-        mmap_length = MAX_DENSE_HEAP;
-    }
-
-    int dev_zero = open("/dev/zero", O_RDWR);
-    void *start = sparse ? NULL : TRY_DENSE_HEAP_START;
-    void *addr = mmap(start,                  /* suggested start*/
-                      mmap_length,            /* length */
-                      PROT_READ | PROT_WRITE, /* permissions */
-                      MAP_PRIVATE,            /* private or shared? */
-                      dev_zero,               /* fd */
-                      0);                     /* offset */
-    if (addr == MAP_FAILED)
-    {
-        fprintf(stderr, "FAILURE.  mmap couldn't allocate space for heap\n");
-        exit(1);
-    }
-    if (sparse)
-    {
-        /* Use initial space for page table */
-        page_table = (mem_block_t **)addr;
+        num_pages = (size_t)(sparse_limit / fbytes_per_page);
+        /* Both grow as pages are used, up to that many */
+        resize_page_table(MIN_BUCKETS);
+        reset_pages();
         heap = SPARSE_HEAP_START;
         mem_max_addr = heap + MAX_SPARSE_HEAP;
+        stats_printed = false;
+        mem_brk = heap;
+        peak_bytes = 0;
+        setUBCheck(true);
+        return;
     }
-    else
+
+    /* Dense allocation.  The heap is mapped the first time round and kept
+     * for the rest of the process; mem_deinit only gives its pages back. */
+    num_pages = 0;
+    if (dense_heap == NULL)
     {
-        heap = addr;
-        mem_max_addr = heap + MAX_DENSE_HEAP;
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS | (prefault ? MAP_POPULATE : 0);
+        void *addr = mmap(TRY_DENSE_HEAP_START,   /* suggested start*/
+                          MAX_DENSE_HEAP,         /* length */
+                          PROT_READ | PROT_WRITE, /* permissions */
+                          flags,                  /* private, anonymous */
+                          -1,                     /* fd */
+                          0);                     /* offset */
+        if (addr == MAP_FAILED)
+        {
+            fprintf(stderr,
+                    "FAILURE.  mmap couldn't allocate space for heap\n");
+            exit(1);
+        }
+        dense_heap = addr;
     }
+    heap = dense_heap;
+    mem_max_addr = heap + MAX_DENSE_HEAP;
     stats_printed = false;
     mem_brk = heap;
+    peak_bytes = 0;
+}
+
+/*
+ * mem_set_sparse_limit - set how much memory sparse emulation may use for
+ *    its pages and page table from the next mem_init on; 0 restores the
+ *    default, which matches the dense heap
+ */
+void mem_set_sparse_limit(size_t bytes)
+{
+    sparse_limit = bytes > 0 ? bytes : MAX_DENSE_HEAP;
+}
+
+/*
+ * mem_set_prefault - choose whether the dense heap is faulted in once, when
+ *    it is first mapped, and then kept resident: neither mem_deinit nor
+ *    mem_discard give its pages back, and new mappings are faulted in as
+ *    they are made.  Nothing that is timed then takes page faults on the
+ *    heap, at the cost of the heap no longer reading as zeros after
+ *    mem_deinit.  Must be called before the first mem_init.
+ */
+void mem_set_prefault(bool on)
+{
+    prefault = on;
 }
 
 /*
@@ -181,11 +296,11 @@ void mem_init(bool do_sparse)
 void mem_deinit(void)
 {
     print_stats();
-    munmap(heap, mmap_length);
-    next_free_page = NULL;
-    num_free_pages = 0;
-    page_table = NULL;
-    num_buckets = 0;
+    unmap_all();
+    if (sparse)
+        release_slabs();
+    else if (!prefault)
+        madvise(heap, MAX_DENSE_HEAP, MADV_DONTNEED);
 }
 
 /*
@@ -194,14 +309,10 @@ void mem_deinit(void)
 void mem_reset_brk()
 {
     print_stats();
+    unmap_all();
     if (sparse)
     {
-        /* Clear page table */
-        size_t ptb = num_buckets * sizeof(mem_block_t *);
-        memset((void *)page_table, 0, ptb);
-        /* First page is just beyond page table */
-        next_free_page = (mem_block_t *)((unsigned char *)page_table + ptb);
-        num_free_pages = num_pages;
+        reset_pages();
     }
     else
     {
@@ -218,27 +329,28 @@ void mem_reset_brk()
 #endif
     }
     mem_brk = heap;
+    peak_bytes = 0;
 }
 
 /*
  * mem_sbrk - simple model of the sbrk function. Extends the heap
  *                by incr bytes and returns the start address of the new area.
- * In this model, the heap cannot be shrunk.
+ * A negative incr shrinks the heap instead, and returns the old break.
  */
 void *mem_sbrk(intptr_t incr)
 {
     unsigned char *old_brk = mem_brk;
 
     bool ok = true;
-    if (incr < 0)
+    if (incr < 0 && (size_t)-incr > (size_t)(mem_brk - heap))
     {
         ok = false;
         fprintf(stderr,
-                "ERROR: mem_sbrk failed.  Attempt to expand heap by negative "
-                "value %ld\n",
-                (long)incr);
+                "ERROR: mem_sbrk failed.  Attempt to shrink heap by %ld "
+                "bytes, but it only has %zu\n",
+                (long)-incr, (size_t)(mem_brk - heap));
     }
-    else if (mem_brk + incr > mem_max_addr)
+    else if (incr > 0 && mem_brk + incr > mem_max_addr)
     {
         ok = false;
         size_t alloc = mem_brk - heap + incr;
@@ -247,7 +359,7 @@ void *mem_sbrk(intptr_t incr)
                 "heap size of %zd (0x%zx) bytes\n",
                 alloc, alloc);
     }
-    else if (!sparse && sbrk(incr) == (void *)-1)
+    else if (!sparse && incr > 0 && !take_real_brk(mem_heapsize() + incr))
     {
         ok = false;
         fprintf(
@@ -258,10 +370,18 @@ void *mem_sbrk(intptr_t incr)
     if (ok)
     {
 #ifdef USE_ASAN
-        /* Mark the extended section of the heap as addressable */
-        __asan_unpoison_memory_region(mem_brk, incr);
+        /* Mark the extended section of the heap as addressable, or the
+         * released one as unaddressable */
+        if (incr >= 0)
+            __asan_unpoison_memory_region(mem_brk, incr);
+        else
+            __asan_poison_memory_region(mem_brk + incr, -incr);
 #endif
         mem_brk += incr;
+        if (incr < 0)
+            mem_discard(mem_brk, (size_t)-incr);
+        else
+            note_peak();
         return (void *)old_brk;
     }
     else
@@ -295,6 +415,230 @@ size_t mem_heapsize()
     return (size_t)(mem_brk - heap);
 }
 
+/*
+ * mem_peak_heapsize() - returns the most bytes the heap and the mappings
+ *    have held at once since the heap was last reset
+ */
+size_t mem_peak_heapsize()
+{
+    return peak_bytes;
+}
+
+/*
+ * mem_reset_peak - start mem_peak_heapsize over from the current heap and
+ *    mappings
+ */
+void mem_reset_peak()
+{
+    peak_bytes = 0;
+    note_peak();
+}
+
+/*
+ * mem_discard - tell the memory system that the bytes in [start, start+len)
+ *    are no longer needed.  In dense mode, every whole page in the range
+ *    is handed back to the OS and reads as zeros from then on.  Sparse
+ *    emulation never gives pages back, so there it does nothing.
+ */
+void mem_discard(void *start, size_t len)
+{
+    size_t psize = mem_pagesize();
+    uintptr_t lo = ((uintptr_t)start + psize - 1) & ~(psize - 1);
+    uintptr_t hi = ((uintptr_t)start + len) & ~(psize - 1);
+
+    if (sparse || prefault || hi <= lo)
+        return;
+    madvise((void *)lo, hi - lo, MADV_DONTNEED);
+}
+
+/*
+ * mem_resident - returns the number of heap and mapping bytes backed by
+ *    physical memory.  Sparse emulation counts the pages it has handed out.
+ */
+size_t mem_resident()
+{
+    if (sparse)
+        return (num_pages - num_free_pages) * SPARSE_PAGE_SIZE;
+
+    size_t pages = resident_pages(heap, mem_brk);
+    for (mem_map_t *map = maps; map != NULL; map = map->next)
+        pages += resident_pages(map->start, map->start + map->len);
+    return pages * mem_pagesize();
+}
+
+/*
+ * mem_map - model of an anonymous mmap: returns a new mapping of len bytes
+ *    (rounded up to whole pages), or NULL if there is no room for it.  In
+ *    dense mode the heap and the mappings share one budget of
+ *    MAX_DENSE_HEAP bytes.
+ */
+void *mem_map(size_t len)
+{
+    size_t psize = mem_pagesize();
+    unsigned char *start;
+
+    len = (len + psize - 1) & ~(psize - 1);
+    if (len == 0)
+        return NULL;
+
+    if (sparse)
+    {
+        if ((start = place_map(len)) == NULL)
+            return NULL;
+    }
+    else
+    {
+        if (len > MAX_DENSE_HEAP - mem_heapsize() - map_bytes)
+        {
+            errno = ENOMEM;
+            return NULL;
+        }
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS | (prefault ? MAP_POPULATE : 0);
+        start = mmap(NULL, len, PROT_READ | PROT_WRITE, flags, -1, 0);
+        if (start == MAP_FAILED)
+            return NULL;
+    }
+
+    mem_map_t *map = malloc(sizeof(mem_map_t));
+    if (map == NULL)
+    {
+        fprintf(stderr, "FAILURE.  malloc failed in mem_map\n");
+        exit(1);
+    }
+    map->start = start;
+    map->len = len;
+    map->pages = NULL;
+    insert_map(map);
+    map_bytes += len;
+    note_peak();
+    return start;
+}
+
+/*
+ * mem_unmap - model of munmap: releases a mapping made with mem_map.  Only
+ *    whole mappings can be released.
+ */
+void mem_unmap(void *start, size_t len)
+{
+    mem_map_t **link = &maps;
+    while (*link != NULL && (*link)->start != start)
+        link = &(*link)->next;
+
+    mem_map_t *map = *link;
+    if (map == NULL || map->len != ((len + mem_pagesize() - 1) &
+                                    ~(mem_pagesize() - 1)))
+    {
+        fprintf(stderr,
+                "ERROR: mem_unmap failed.  No mapping of %zu bytes at %p\n",
+                len, start);
+        return;
+    }
+
+    *link = map->next;
+    map_bytes -= map->len;
+    if (sparse)
+        release_pages(map, 0);
+    else
+        munmap(map->start, map->len);
+    free(map);
+}
+
+/*
+ * mem_remap - model of mremap with MREMAP_MAYMOVE: resizes a mapping to
+ *    new_len bytes, moving it if it cannot grow in place.  Returns the new
+ *    start of the mapping, or NULL if there is no room for it (in which
+ *    case the old mapping is left alone).
+ */
+void *mem_remap(void *start, size_t old_len, size_t new_len)
+{
+    size_t psize = mem_pagesize();
+    mem_map_t **link = &maps;
+    while (*link != NULL && (*link)->start != start)
+        link = &(*link)->next;
+
+    mem_map_t *map = *link;
+    old_len = (old_len + psize - 1) & ~(psize - 1);
+    new_len = (new_len + psize - 1) & ~(psize - 1);
+    if (map == NULL || map->len != old_len || new_len == 0)
+    {
+        fprintf(stderr,
+                "ERROR: mem_remap failed.  No mapping of %zu bytes at %p\n",
+                old_len, start);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (new_len > old_len && !sparse &&
+        new_len - old_len > MAX_DENSE_HEAP - mem_heapsize() - map_bytes)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    unsigned char *new_start = map->start;
+    if (sparse)
+    {
+        unsigned char *limit =
+            map->next ? map->next->start : SPARSE_MAP_START + MAX_SPARSE_MAP;
+        if (new_len <= old_len)
+        {
+            release_pages(map, new_len);
+        }
+        else if ((size_t)(limit - map->start) < new_len)
+        {
+            /* Look for a new place with the old one out of the way, since
+             * the new one may overlap it */
+            *link = map->next;
+            if ((new_start = place_map(new_len)) == NULL)
+            {
+                insert_map(map);
+                return NULL;
+            }
+            move_pages(map, new_start);
+            map->start = new_start;
+            insert_map(map);
+        }
+    }
+    else
+    {
+        new_start = mremap(map->start, old_len, new_len, MREMAP_MAYMOVE);
+        if (new_start == MAP_FAILED)
+            return NULL;
+        if (new_start != map->start)
+        {
+            /* Keep the list in address order */
+            *link = map->next;
+            map->start = new_start;
+            insert_map(map);
+        }
+    }
+
+    map->start = new_start;
+    map->len = new_len;
+    map_bytes += new_len - old_len;
+    note_peak();
+    return new_start;
+}
+
+/*
+ * mem_mapped - returns whether all of [start, start+len) lies inside a
+ *    single mapping made with mem_map
+ */
+bool mem_mapped(const void *start, size_t len)
+{
+    mem_map_t *map = find_map(start);
+    return map != NULL &&
+           (size_t)(map->start + map->len - (unsigned char *)start) >= len;
+}
+
+/*
+ * mem_mapsize - returns the total length of the live mappings
+ */
+size_t mem_mapsize()
+{
+    return map_bytes;
+}
+
 /*
  * mem_pagesize() - returns the page size of the system
  */
@@ -323,10 +667,9 @@ void mem_write128(void *addr, __int128 val)
 uint64_t mem_read(const void *addr, size_t len)
 {
     uint64_t rdata;
-    if (sparse && (unsigned char *)addr >= heap &&
-        (unsigned char *)addr + len <= mem_brk)
+    if (emulated(addr, len))
     {
-        /* Heap read.  Check if it crosses page boundary */
+        /* Heap or mapping read.  Check if it crosses page boundary */
         size_t id = page_id(addr);
         void *paddr = get_mem(addr, len, false);
         rdata = *(uint64_t *)paddr;
@@ -367,10 +710,9 @@ uint64_t mem_read(const void *addr, size_t len)
 /* Write lower order len bytes of val to address */
 void mem_write(void *addr, uint64_t val, size_t len)
 {
-    if (sparse && (unsigned char *)addr >= heap &&
-        (unsigned char *)addr + len <= mem_brk)
+    if (emulated(addr, len))
     {
-        /* Heap write.  Check to see if it crosses page boundary */
+        /* Heap or mapping write.  Check to see if it crosses page boundary */
         size_t id = page_id(addr);
         void *paddr = get_mem(addr, len, true);
         void *saddr = page_start(id);
@@ -410,48 +752,149 @@ void mem_write(void *addr, uint64_t val, size_t len)
     }
 }
 
-/* Emulation of memcpy */
-void *mem_memcpy(void *dst, const void *src, size_t num_bytes)
+#ifdef USE_STREAMING
+/*
+ * Copy num_bytes with 16-byte non-temporal stores to the aligned part of
+ * dst.  Neither end needs to be aligned; the stores are fenced before
+ * returning, so they are ordered like ordinary ones for the caller.
+ */
+static void stream_copy(unsigned char *dst, const unsigned char *src,
+                        size_t num_bytes)
+{
+    size_t head = (size_t)(-(uintptr_t)dst & 15);
+
+    memmove(dst, src, head);
+    dst += head;
+    src += head;
+    num_bytes -= head;
+    for (; num_bytes >= 64; num_bytes -= 64, dst += 64, src += 64)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)src);
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(src + 32));
+        __m128i d = _mm_loadu_si128((const __m128i *)(src + 48));
+        _mm_stream_si128((__m128i *)dst, a);
+        _mm_stream_si128((__m128i *)(dst + 16), b);
+        _mm_stream_si128((__m128i *)(dst + 32), c);
+        _mm_stream_si128((__m128i *)(dst + 48), d);
+    }
+    _mm_sfence();
+    memmove(dst, src, num_bytes);
+}
+
+/* Fill num_bytes with c, the same way as stream_copy */
+static void stream_fill(unsigned char *dst, int c, size_t num_bytes)
+{
+    size_t head = (size_t)(-(uintptr_t)dst & 15);
+    __m128i v = _mm_set1_epi8((char)c);
+
+    memset(dst, c, head);
+    dst += head;
+    num_bytes -= head;
+    for (; num_bytes >= 64; num_bytes -= 64, dst += 64)
+    {
+        _mm_stream_si128((__m128i *)dst, v);
+        _mm_stream_si128((__m128i *)(dst + 16), v);
+        _mm_stream_si128((__m128i *)(dst + 32), v);
+        _mm_stream_si128((__m128i *)(dst + 48), v);
+    }
+    _mm_sfence();
+    memset(dst, c, num_bytes);
+}
+#endif /* USE_STREAMING */
+
+/*
+ * Copy a word at a time through mem_read and mem_write, front to back.  With
+ * dst inside [src, src + num_bytes), every word read may include bytes that
+ * an earlier write put there, so the source repeats across the destination;
+ * this is what mem_memcpy has always done for such overlaps.
+ */
+static void copy_words(unsigned char *dst, const unsigned char *src,
+                       size_t num_bytes)
 {
-    void *savedst = dst;
     size_t word_size = sizeof(uint64_t);
     while (num_bytes >= word_size)
     {
         uint64_t data = mem_read(src, word_size);
         mem_write(dst, data, word_size);
         num_bytes -= word_size;
-        src = (void *)((unsigned char *)src + word_size);
-        dst = (void *)((unsigned char *)dst + word_size);
+        src += word_size;
+        dst += word_size;
     }
     if (num_bytes)
     {
         uint64_t data = mem_read(src, num_bytes);
         mem_write(dst, data, num_bytes);
     }
-    return savedst;
 }
 
-/* Emulation of memset */
-void *mem_memset(void *dst, int c, size_t num_bytes)
+/*
+ * Emulation of memcpy.  Nothing is emulated in dense mode, so the bytes are
+ * copied with libc's vectorized memcpy, or streamed if there are many of
+ * them.  In sparse mode the copy goes forwards one page-contiguous span at
+ * a time: each emulated page is looked up once, and the initialization
+ * bits are checked and set for the whole span, exactly as word-by-word
+ * mem_read and mem_write calls would have.  A destination that starts
+ * inside the source is still copied a word at a time, in either mode, since
+ * neither libc nor a span-wise copy would give the same bytes.
+ */
+void *mem_memcpy(void *dst, const void *src, size_t num_bytes)
 {
     void *savedst = dst;
-    uint64_t byte = c & 0xFF;
-    uint64_t data = 0;
-    size_t word_size = sizeof(uint64_t);
-    size_t i;
-    for (i = 0; i < word_size; i++)
+    const unsigned char *from = src;
+    unsigned char *to = dst;
+    if (to > from && to < from + num_bytes)
     {
-        data = data | (byte << (8 * i));
+        copy_words(to, from, num_bytes);
+        return savedst;
     }
-    while (num_bytes >= word_size)
+    if (!sparse)
     {
-        mem_write(dst, data, word_size);
-        num_bytes -= word_size;
-        dst = (void *)((unsigned char *)dst + word_size);
+#ifdef USE_STREAMING
+        if (num_bytes >= STREAM_MIN_BYTES)
+        {
+            stream_copy(dst, src, num_bytes);
+            return savedst;
+        }
+#endif
+        return memmove(dst, src, num_bytes);
     }
-    if (num_bytes)
+    while (num_bytes > 0)
     {
-        mem_write(dst, data, num_bytes);
+        size_t len = page_span(to, page_span(from, num_bytes));
+        const void *src_bytes = emulated(from, len) ? get_mem(from, len, false)
+                                                    : from;
+        void *dst_bytes = emulated(to, len) ? get_mem(to, len, true) : to;
+        memmove(dst_bytes, src_bytes, len);
+        from += len;
+        to += len;
+        num_bytes -= len;
+    }
+    return savedst;
+}
+
+/* Emulation of memset, in the same way as mem_memcpy */
+void *mem_memset(void *dst, int c, size_t num_bytes)
+{
+    void *savedst = dst;
+    if (!sparse)
+    {
+#ifdef USE_STREAMING
+        if (num_bytes >= STREAM_MIN_BYTES)
+        {
+            stream_fill(dst, c, num_bytes);
+            return savedst;
+        }
+#endif
+        return memset(dst, c, num_bytes);
+    }
+    unsigned char *to = dst;
+    while (num_bytes > 0)
+    {
+        size_t len = page_span(to, num_bytes);
+        memset(emulated(to, len) ? get_mem(to, len, true) : to, c, len);
+        to += len;
+        num_bytes -= len;
     }
     return savedst;
 }
@@ -463,7 +906,11 @@ void hprobe(void *ptr, int offset, size_t count)
     unsigned char *cptr_lo = cptr + offset;
     unsigned char *cptr_hi = cptr_lo + count - 1;
     unsigned char *iptr;
-    if ((void *)cptr_lo < mem_heap_lo())
+    if (mem_mapped(cptr_lo, count))
+    {
+        /* Inside a mapping, so fine */
+    }
+    else if ((void *)cptr_lo < mem_heap_lo())
     {
         fprintf(stderr, "Invalid probe.  Address %p is below start of heap\n",
                 cptr_lo);
@@ -509,6 +956,283 @@ static void print_stats()
     stats_printed = true;
 }
 
+/* Is [addr, addr+len) emulated, as part of the heap or a mapping? */
+static bool emulated(const void *addr, size_t len)
+{
+    const unsigned char *p = addr;
+    return sparse && ((p >= heap && p + len <= mem_brk) ||
+                      (p >= SPARSE_MAP_START &&
+                       p + len <= SPARSE_MAP_START + MAX_SPARSE_MAP));
+}
+
+/* Find the mapping holding an address, if any */
+static mem_map_t *find_map(const void *addr)
+{
+    const unsigned char *p = addr;
+    for (mem_map_t *map = maps; map != NULL && map->start <= p;
+         map = map->next)
+    {
+        if (p < map->start + map->len)
+            return map;
+    }
+    return NULL;
+}
+
+/* Put a mapping into the list, in address order */
+static void insert_map(mem_map_t *map)
+{
+    mem_map_t **link = &maps;
+    while (*link != NULL && (*link)->start < map->start)
+        link = &(*link)->next;
+    map->next = *link;
+    *link = map;
+}
+
+/* Find room for a sparse mapping: first fit among the gaps between the
+ * existing ones */
+static unsigned char *place_map(size_t len)
+{
+    unsigned char *start = SPARSE_MAP_START;
+    for (mem_map_t *map = maps; map != NULL; map = map->next)
+    {
+        if ((size_t)(map->start - start) >= len)
+            break;
+        start = map->start + map->len;
+    }
+    if ((size_t)(SPARSE_MAP_START + MAX_SPARSE_MAP - start) < len)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return start;
+}
+
+/* Drop every mapping.  Sparse pages are not given back one by one, since
+ * the whole page table is about to be cleared anyway. */
+static void unmap_all(void)
+{
+    while (maps != NULL)
+    {
+        mem_map_t *map = maps;
+        maps = map->next;
+        if (!sparse)
+            munmap(map->start, map->len);
+        free(map);
+    }
+    map_bytes = 0;
+}
+
+/* Raise the high-water mark to the current heap and mappings */
+static void note_peak(void)
+{
+    size_t bytes = mem_heapsize() + map_bytes;
+    if (bytes > peak_bytes)
+        peak_bytes = bytes;
+}
+
+/*
+ * Make sure the real break has been moved by at least bytes in all, as the
+ * dense heap has to be that big.  Real break space is never handed back,
+ * since libc may have grown past it, so a heap that shrinks and grows again
+ * only calls sbrk once it gets past its old high-water mark.
+ */
+static bool take_real_brk(size_t bytes)
+{
+    if (bytes <= real_brk_bytes)
+        return true;
+    if (sbrk((intptr_t)(bytes - real_brk_bytes)) == (void *)-1)
+        return false;
+    real_brk_bytes = bytes;
+    return true;
+}
+
+/*
+ * Take a page that was never used since the last reset from the current
+ * slab, mapping a new slab once all of them are used up.  Slabs are kept
+ * until mem_deinit, so later runs on the same memory system reuse them.
+ */
+static mem_block_t *new_page(void)
+{
+    if (cur_slab == NULL || cur_slab_used == SLAB_PAGES)
+    {
+        page_slab_t *next = cur_slab != NULL ? cur_slab->next : slabs;
+        if (next == NULL)
+        {
+            next = mmap(NULL, SLAB_BYTES, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (next == MAP_FAILED)
+            {
+                fprintf(stderr, "FAILURE.  mmap couldn't allocate space for "
+                                "emulation\n");
+                exit(1);
+            }
+            next->next = NULL;
+            if (cur_slab != NULL)
+                cur_slab->next = next;
+            else
+                slabs = next;
+        }
+        cur_slab = next;
+        cur_slab_used = 0;
+    }
+    return &cur_slab->pages[cur_slab_used++];
+}
+
+/* Empty the page table and make every page of every slab free again */
+static void reset_pages(void)
+{
+    memset(page_table, 0, num_buckets * sizeof(mem_block_t *));
+    memset(tlb, 0, sizeof(tlb));
+    cur_slab = NULL;
+    cur_slab_used = 0;
+    num_free_pages = num_pages;
+    free_pages = NULL;
+}
+
+/* Give all the slabs and the page table back to the system */
+static void release_slabs(void)
+{
+    while (slabs != NULL)
+    {
+        page_slab_t *slab = slabs;
+        slabs = slab->next;
+        munmap(slab, SLAB_BYTES);
+    }
+    free(page_table);
+    page_table = NULL;
+    num_buckets = 0;
+    bucket_shift = 64;
+    cur_slab = NULL;
+    cur_slab_used = 0;
+    num_free_pages = 0;
+    free_pages = NULL;
+    memset(tlb, 0, sizeof(tlb));
+}
+
+/*
+ * Hash a page ID to its bucket.  The heap's IDs come in runs of consecutive
+ * ones, and the giant blocks of sparse traces put the pages that are used
+ * at large power-of-2 strides, so every bit of the ID is mixed into the
+ * top ones that pick the bucket (the finalizer of MurmurHash3).
+ */
+static size_t page_hash(size_t id)
+{
+    uint64_t h = id;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdUL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53UL;
+    h ^= h >> 33;
+    return (size_t)(h >> bucket_shift);
+}
+
+/*
+ * Give the page table a new number of buckets, a power of 2, and file every
+ * page again under its new bucket.  Doubling it whenever the pages outgrow
+ * HASH_LOAD per bucket keeps the cost of a lookup the same however big the
+ * heap gets.
+ */
+static void resize_page_table(size_t buckets)
+{
+    mem_block_t **table = calloc(buckets, sizeof(mem_block_t *));
+    if (table == NULL)
+    {
+        fprintf(stderr, "FAILURE.  calloc failed in resize_page_table\n");
+        exit(1);
+    }
+
+    mem_block_t **old_table = page_table;
+    size_t old_buckets = num_buckets;
+    page_table = table;
+    num_buckets = buckets;
+    for (bucket_shift = 64; buckets > 1; buckets /= 2)
+        bucket_shift--;
+
+    for (size_t b = 0; b < old_buckets; b++)
+    {
+        mem_block_t *block = old_table[b];
+        while (block != NULL)
+        {
+            mem_block_t *next = block->next;
+            size_t nb = page_hash(block->id);
+            block->next = page_table[nb];
+            page_table[nb] = block;
+            block = next;
+        }
+    }
+    free(old_table);
+}
+
+/* Take a page out of its hash bucket and out of the lookup cache */
+static void unlink_page(mem_block_t *block)
+{
+    mem_block_t **link = &page_table[page_hash(block->id)];
+    while (*link != block)
+        link = &(*link)->next;
+    *link = block->next;
+
+    tlb_entry_t *entry = &tlb[block->id % TLB_ENTRIES];
+    if (entry->block == block)
+        entry->block = NULL;
+}
+
+/* Give back the pages of a sparse mapping that lie keep or more bytes past
+ * its start */
+static void release_pages(mem_map_t *map, size_t keep)
+{
+    mem_block_t **link = &map->pages;
+    while (*link != NULL)
+    {
+        mem_block_t *block = *link;
+        if ((unsigned char *)page_start(block->id) < map->start + keep)
+        {
+            link = &block->map_next;
+            continue;
+        }
+        *link = block->map_next;
+        unlink_page(block);
+        block->next = free_pages;
+        free_pages = block;
+        num_free_pages++;
+    }
+}
+
+/* Move the pages of a sparse mapping to a new start address, by filing
+ * them under new page IDs */
+static void move_pages(mem_map_t *map, unsigned char *start)
+{
+    size_t shift = page_id(start) - page_id(map->start);
+    for (mem_block_t *block = map->pages; block != NULL;
+         block = block->map_next)
+    {
+        unlink_page(block);
+        block->id += shift;
+        size_t b = page_hash(block->id);
+        block->next = page_table[b];
+        page_table[b] = block;
+    }
+}
+
+/* Count the resident pages in [lo, hi), where lo is page aligned */
+static size_t resident_pages(unsigned char *lo, unsigned char *hi)
+{
+    size_t psize = mem_pagesize();
+    unsigned char vec[1024];
+    size_t resident = 0;
+    while (lo < hi)
+    {
+        size_t len = (size_t)(hi - lo);
+        if (len > sizeof(vec) * psize)
+            len = sizeof(vec) * psize;
+        if (mincore(lo, len, vec) != 0)
+            return 0;
+        for (size_t i = 0; i < (len + psize - 1) / psize; i++)
+            resident += vec[i] & 1;
+        lo += len;
+    }
+    return resident;
+}
+
 /* Given an address, compute the ID  of its page */
 static size_t page_id(const void *addr)
 {
@@ -516,6 +1240,13 @@ static size_t page_id(const void *addr)
     return offset / SPARSE_PAGE_SIZE;
 }
 
+/* How many of the len bytes from addr lie in the same page as addr */
+static size_t page_span(const void *addr, size_t len)
+{
+    size_t left = SPARSE_PAGE_SIZE - (uintptr_t)addr % SPARSE_PAGE_SIZE;
+    return len < left ? len : left;
+}
+
 /* Given a page ID, compute its starting address */
 static void *page_start(size_t id)
 {
@@ -523,18 +1254,24 @@ static void *page_start(size_t id)
     return (void *)((unsigned char *)SPARSE_HEAP_START + offset);
 }
 
-/* Get memory to store value.  Allocate page if necessary */
-static void *get_mem(const void *addr, size_t size, bool isWrite)
+/* Find the page with an ID in the hash table, allocating it if necessary */
+static mem_block_t *find_page(const void *addr, size_t id)
 {
-    size_t id = page_id(addr);
-    size_t b = id % num_buckets; // A very simple hash function
-    unsigned int i;
-
+    size_t b = page_hash(id);
     mem_block_t *block = page_table[b];
     while (block && block->id != id)
         block = block->next;
     if (!block)
     {
+        /* Pages of a mapping are tracked by the mapping */
+        mem_map_t *map = NULL;
+        if ((const unsigned char *)addr >= SPARSE_MAP_START &&
+            (map = find_map(addr)) == NULL)
+        {
+            fprintf(stderr, "FAILURE.  Access to unmapped address %p\n", addr);
+            abort();
+        }
+
         /* Need to allocate a new block */
         if (num_free_pages == 0)
         {
@@ -547,13 +1284,53 @@ static void *get_mem(const void *addr, size_t size, bool isWrite)
             fprintf(stderr, "FAILURE.  Ran out of memory for emulation\n");
             exit(1);
         }
-        block = next_free_page++;
+        if (free_pages != NULL)
+        {
+            block = free_pages;
+            free_pages = block->next;
+            memset(block->bytes, 0, SPARSE_PAGE_SIZE);
+        }
+        else
+            block = new_page();
         num_free_pages--;
         block->id = id;
         block->next = page_table[b];
-        for (i = 0; i < (SPARSE_PAGE_SIZE / 8); i++)
-            block->initSet[i] = 0;
+        if (map != NULL)
+        {
+            /* A mapping reads as zeros, even on a page reused from an
+             * earlier run, and none of it counts as uninitialized */
+            block->map_next = map->pages;
+            map->pages = block;
+            memset(block->bytes, 0, SPARSE_PAGE_SIZE);
+            memset(block->initSet, 0xff, sizeof(block->initSet));
+        }
+        else
+            memset(block->initSet, 0, sizeof(block->initSet));
         page_table[b] = block;
+
+        /* Keep at most HASH_LOAD pages per bucket as the heap grows */
+        if (num_pages - num_free_pages > num_buckets * HASH_LOAD)
+            resize_page_table(num_buckets * 2);
+    }
+    return block;
+}
+
+/*
+ * Get memory to store value.  Allocate page if necessary.  The pages used
+ * last are cached by ID in a small direct-mapped table, which catches most
+ * accesses, since the allocator keeps coming back to the same few blocks.
+ */
+static void *get_mem(const void *addr, size_t size, bool isWrite)
+{
+    size_t id = page_id(addr);
+    tlb_entry_t *entry = &tlb[id % TLB_ENTRIES];
+    mem_block_t *block = entry->block;
+
+    if (block == NULL || entry->id != id)
+    {
+        block = find_page(addr, id);
+        entry->id = id;
+        entry->block = block;
     }
 
     // Convert an emulated address into an offset
@@ -561,21 +1338,31 @@ static void *get_mem(const void *addr, size_t size, bool isWrite)
     size_t offset = (unsigned char *)addr - (unsigned char *)saddr;
 
 #ifndef NO_CHECK_UB
-    // Compute the bit vector lookup for this 'offset'
-    size_t offsetIdx = offset / 8;
-    size_t offsetBit = offset & 0x7;
+    // Only the part of the access inside this page is tracked here; mem_read
+    //  and mem_write look up the rest of a straddling access on their own.
+    if (size > SPARSE_PAGE_SIZE - offset)
+        size = SPARSE_PAGE_SIZE - offset;
 
-    // For each byte in this access, update the bitvector that tracks
-    //  the use / initialization of emulated bytes.
-    for (i = 0; i < size; i++)
+    // The bitvector tracks the use / initialization of emulated bytes, one
+    //  bit per byte.  An access of at most 8 bytes covers bits in one or
+    //  two of its words, a bulk copy or fill up to a page's worth.
+    for (size_t done = 0; done < size;)
     {
+        uint64_t *word = &block->initSet[(offset + done) / 64];
+        size_t shift = (offset + done) % 64;
+        size_t len = size - done < 64 - shift ? size - done : 64 - shift;
+        uint64_t mask = len < 64 ? ((uint64_t)1 << len) - 1 : ~(uint64_t)0;
+        mask <<= shift;
+
         if (isWrite)
         {
-            block->initSet[offsetIdx] |= (0x1 << offsetBit);
+            *word |= mask;
         }
-        else if (checkUB &&
-                 (block->initSet[offsetIdx] & (0x1 << offsetBit)) == 0)
+        else if (checkUB && (*word & mask) != mask)
         {
+            // The first byte of the access that was never written to
+            size_t i = done + (size_t)__builtin_ctzll(~*word & mask) - shift;
+
             // The student code has attempted to read an address that was
             //  never written to.  Students should set a breakpoint on this
             //  line / check and then backtrace to where their code has
@@ -586,14 +1373,7 @@ static void *get_mem(const void *addr, size_t size, bool isWrite)
                     (addr + i), __FILE__, __LINE__);
             abort();
         }
-        offsetBit++;
-        if (offsetBit == 8)
-        {
-            offsetBit = 0;
-            offsetIdx++;
-        }
-        if (offsetIdx == (SPARSE_PAGE_SIZE / 8))
-            break;
+        done += len;
     }
 #endif
 
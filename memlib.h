@@ -21,16 +21,41 @@ void mem_init(bool sparse);
  */
 void mem_deinit(void);
 
+/**
+ * @brief Sets how much memory sparse emulation may use.
+ *
+ * The pages and the page table of sparse emulation grow as the heap is
+ * used, up to this limit, beyond which the emulation fails. It applies
+ * from the next call to mem_init.
+ *
+ * @param[in] bytes The limit, in bytes, or 0 for the default, the size of
+ *                  the dense heap
+ */
+void mem_set_sparse_limit(size_t bytes);
+
+/**
+ * @brief Chooses whether the dense heap is kept resident.
+ *
+ * The dense heap is mapped once per process. Normally mem_deinit gives its
+ * pages back, so that the next trace starts on a heap that reads as zeros and
+ * faults its pages in again. With prefault on, the heap is faulted in when it
+ * is mapped and never given back, by mem_deinit or mem_discard, and mappings
+ * are faulted in as they are made, so timed runs take no page faults on them.
+ *
+ * @param[in] on Whether to pre-fault; must be set before the first mem_init
+ */
+void mem_set_prefault(bool on);
+
 /**
  * @brief Extends the heap by incr bytes.
  *
- * This function is a simple model of the sbrk() function, except for that
- * with this implementation, the heap cannot be shrunk.
+ * This function is a simple model of the sbrk() function. A negative `incr`
+ * shrinks the heap by `-incr` bytes instead.
  *
  * @param[in] incr The amount of bytes by which to extend the heap
  * @return The start address of the new heap area (i.e. the previous
  *         breakpoint)
- * @pre `incr > 0`
+ * @pre `-incr <= mem_heapsize()`
  */
 void *mem_sbrk(intptr_t incr);
 
@@ -61,6 +86,88 @@ void *mem_heap_hi(void);
  */
 size_t mem_heapsize(void);
 
+/**
+ * @brief Returns the most bytes the heap and the mappings held at once.
+ *
+ * The high-water mark is kept as the heap and the mappings grow, so it also
+ * counts growth that was given back within the same call to the allocator.
+ * It starts over whenever the heap is reset.
+ *
+ * @return The peak size of the heap plus the mappings, in bytes
+ */
+size_t mem_peak_heapsize(void);
+
+/**
+ * @brief Starts the mem_peak_heapsize high-water mark over from the current
+ * size of the heap and the mappings.
+ */
+void mem_reset_peak(void);
+
+/**
+ * @brief Lets the memory system reclaim a range of the heap.
+ *
+ * Whole pages inside the range may be returned to the OS, after which they
+ * read as zeros. Bytes in partial pages at either end are left untouched.
+ *
+ * @param[in] start The first byte that is no longer needed
+ * @param[in] len   The length of the range, in bytes
+ */
+void mem_discard(void *start, size_t len);
+
+/**
+ * @brief Returns how much of the heap and the mappings is backed by physical
+ * memory.
+ * @return The resident size of the heap and the mappings, in bytes
+ */
+size_t mem_resident(void);
+
+/**
+ * @brief Creates a new mapping, outside of the heap.
+ *
+ * This function is a simple model of an anonymous, private mmap(). The
+ * mapping reads as zeros, and stays valid until it is released with
+ * mem_unmap, regardless of what happens to the heap.
+ *
+ * @param[in] len The length of the mapping, rounded up to whole pages
+ * @return The page-aligned start of the mapping, or NULL if out of memory
+ */
+void *mem_map(size_t len);
+
+/**
+ * @brief Releases a mapping made with mem_map.
+ * @param[in] start The start of the mapping
+ * @param[in] len   The length it was created (or last resized) with
+ */
+void mem_unmap(void *start, size_t len);
+
+/**
+ * @brief Resizes a mapping made with mem_map, moving it if it has to.
+ *
+ * This function is a simple model of mremap() with MREMAP_MAYMOVE: the
+ * contents move along with the mapping without being copied.
+ *
+ * @param[in] start   The start of the mapping
+ * @param[in] old_len The length it was created (or last resized) with
+ * @param[in] new_len The new length, rounded up to whole pages
+ * @return The new start of the mapping, or NULL if out of memory, in which
+ *         case the mapping is left unchanged
+ */
+void *mem_remap(void *start, size_t old_len, size_t new_len);
+
+/**
+ * @brief Checks whether a range of bytes lies inside a single mapping.
+ * @param[in] start The first byte of the range
+ * @param[in] len   The length of the range, in bytes
+ * @return true if all of the range was mapped with mem_map
+ */
+bool mem_mapped(const void *start, size_t len);
+
+/**
+ * @brief Returns the number of bytes in all mappings made with mem_map.
+ * @return The total size of the mappings, in bytes
+ */
+size_t mem_mapsize(void);
+
 /**
  * @brief Returns the system page size.
  * @return The page size of the system, in bytes
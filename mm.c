@@ -20,6 +20,10 @@
  * @author Joshua Yoon <jbyoon@andrew.cmu.edu>
  */
 
+#ifdef MM_THREADS
+#define _GNU_SOURCE // for sched_getcpu
+#endif
+
 #include <assert.h>
 #include <inttypes.h>
 #include <stdbool.h>
@@ -29,6 +33,12 @@
 #include <string.h>
 #include <unistd.h>
 
+#ifdef MM_THREADS
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#endif
+
 #include "memlib.h"
 #include "mm.h"
 
@@ -105,11 +115,150 @@ static const word_t footer_mask = 0x2;
 // allocated/free.
 static const word_t mini_mask = 0x4;
 
+// this is the fourth bit in our header. It is only set on free mini blocks,
+// whose header then holds the payload address of the previous block in the
+// mini free list instead of the size (which is always min_block_size). The
+// next link lives in the body, so the list is doubly linked in 16 bytes.
+static const word_t mini_free_mask = 0x8;
+
 /**
  * TODO: explain what size_mask is
  */
 static const word_t size_mask = ~(word_t)0xF;
 
+// the flag bits of a block with a mapping of its own (see map_alloc). A
+// mini block is never allocated while free, and a slab slot has the footer
+// bit clear, so no other header has exactly these bits set.
+static const word_t mapped_tag = alloc_mask | footer_mask | mini_free_mask;
+
+/**
+ * @brief log2 of the number of size classes per power of two.
+ *
+ * Each power-of-two range of block sizes is split into 2^SEG_SUBCLASS_BITS
+ * geometric sub-classes, as in TLSF. Override with -DSEG_SUBCLASS_BITS=n.
+ */
+#ifndef SEG_SUBCLASS_BITS
+#define SEG_SUBCLASS_BITS 2
+#endif
+
+/**
+ * @brief Number of segregated free lists (at most 64, one bitmap word).
+ *
+ * Blocks past the last class boundary all share the last list. With the
+ * default 4 sub-classes the last list starts at 512 KiB. Override with
+ * -DSEG_LIST_COUNT=n.
+ */
+#ifndef SEG_LIST_COUNT
+#define SEG_LIST_COUNT 56
+#endif
+
+_Static_assert(SEG_LIST_COUNT > (1 << SEG_SUBCLASS_BITS) &&
+                   SEG_LIST_COUNT <= 64,
+               "seg_bitmap has one bit per list");
+
+/** @brief Number of sub-classes per power of two */
+static const size_t seg_sub_count = (size_t)1 << SEG_SUBCLASS_BITS;
+
+/** @brief Number of segregated free lists */
+static const int seg_list_count = SEG_LIST_COUNT;
+
+/** @brief Largest block size of one slab run */
+static const size_t run_size = (1 << 11);
+
+/**
+ * @brief Slots in the first run of a slab class.
+ *
+ * Each further run of the class doubles in size up to run_size, so a class
+ * that only sees a handful of requests doesn't strand a whole run.
+ */
+static const size_t run_min_slots = 4;
+
+/**
+ * @brief Largest block size served from slab runs.
+ *
+ * Small requests get a slot in a run of same-sized slots instead of a block
+ * of their own; each multiple of dsize up to this size is one slab class.
+ * Slots freed in one class can't hold blocks of another, so every class
+ * leaves partly used runs pinned in the heap. Single-threaded, only the
+ * smallest class is worth that; with MM_THREADS the runs also keep small
+ * requests off the arena lock.
+ */
+#ifdef MM_THREADS
+static const size_t slab_max_size = 8 * dsize;
+#define SLAB_CLASS_COUNT 8
+#else
+static const size_t slab_max_size = dsize;
+#define SLAB_CLASS_COUNT 1
+#endif
+
+/** @brief Number of slab classes */
+static const int slab_class_count = SLAB_CLASS_COUNT;
+
+/** @brief Number of bitmap words needed to cover one run's slots */
+#define RUN_MAP_WORDS 2
+
+/**
+ * @brief Smallest free tail block that is given back by shrinking the heap.
+ *
+ * When a free block at least this large sits right before the epilogue,
+ * everything past its first chunksize bytes is handed back with a negative
+ * mem_sbrk (in batches, see release_block). Override with
+ * -DTRIM_THRESHOLD=n; 0 never trims.
+ */
+#ifndef TRIM_THRESHOLD
+#define TRIM_THRESHOLD (1 << 17)
+#endif
+static const size_t trim_threshold = TRIM_THRESHOLD;
+
+/**
+ * @brief Smallest free interior block whose pages are given back.
+ *
+ * The whole pages inside such a block are passed to mem_discard (in batches,
+ * see release_block), so they no longer count against the resident size
+ * while the block sits on a free list. Override with -DRELEASE_THRESHOLD=n;
+ * 0 never releases.
+ */
+#ifndef RELEASE_THRESHOLD
+#define RELEASE_THRESHOLD (1 << 18)
+#endif
+static const size_t release_threshold = RELEASE_THRESHOLD;
+
+/**
+ * @brief Dirty bytes, as a fraction of the heap, that trigger a purge.
+ *
+ * Free blocks big enough to be trimmed or released are not given back right
+ * away, but once the bytes freed into them since the last time add up to
+ * more than 1/purge_ratio of the heap (see release_block).
+ */
+static const size_t purge_ratio = 8;
+
+/**
+ * @brief Smallest request that gets a mapping of its own.
+ *
+ * Such blocks never touch the heap: free unmaps them right away, and realloc
+ * resizes them with mem_remap instead of copying. Override with
+ * -DMMAP_THRESHOLD=n; 0 never maps.
+ */
+#ifndef MMAP_THRESHOLD
+#define MMAP_THRESHOLD (1 << 20)
+#endif
+static const size_t mmap_threshold = MMAP_THRESHOLD;
+
+#ifdef MM_THREADS
+/**
+ * @brief Most arenas a threaded build uses.
+ *
+ * The actual count is the number of online CPUs capped at this, unless the
+ * MM_ARENAS environment variable asks for a different one.
+ */
+#ifndef MM_ARENAS
+#define MM_ARENAS 8
+#endif
+
+/** @brief Address space reserved for each arena after the first */
+static const size_t arena_span = (size_t)1 << 30;
+#endif
+
 /** @brief Represents the header and payload of one block in the heap */
 typedef struct block {
     /** @brief Header contains size + allocation flag */
@@ -140,22 +289,123 @@ typedef struct block {
             void *prev;
             void *next;
         } list_pointers;
-        // if the block is mini, use this space for our free list
+        // if the block is mini, use this space for our free list (the prev
+        // link is packed into the header, see mini_free_mask)
         struct C {
             void *next;
         } mini_pointers;
+        // if the block is a slab run, its bookkeeping comes first, followed
+        // by `capacity` slots of `slot_size` bytes. Every slot starts with a
+        // header word pointing back at the run's payload, tagged with both
+        // alloc_mask and mini_free_mask.
+        struct D {
+            void *prev; // partially used runs of the same class
+            void *next;
+#ifdef MM_THREADS
+            void *owner; // the thread cache whose lists hold this run
+            word_t pad;  // keeps the slots 16-byte aligned
+#endif
+            uint16_t slot_size;
+            uint16_t capacity;
+            uint16_t free_count;
+            uint16_t unused;
+            word_t free_map[RUN_MAP_WORDS]; // bit set = slot is free
+            char slots[0];
+        } run;
         // if the block is allocated, store the payload
         char payload[0];
     } body;
 
 } block_t;
 
+// slots must keep the same alignment as ordinary blocks
+_Static_assert(offsetof(block_t, body.run.slots) % 16 == 0,
+               "slab slots must be 16-byte aligned");
+_Static_assert(RUN_MAP_WORDS * 64 * 16 >= (1 << 11),
+               "run bitmap must cover every slot of a run");
+
+/**
+ * @brief One independent heap: its segregated free lists and the memory its
+ * blocks are carved from.
+ *
+ * Without MM_THREADS there is a single arena, at the start of the memlib
+ * heap. With MM_THREADS there can be up to MM_ARENAS of them, each behind
+ * its own lock: arena 0 grows with mem_sbrk like before, and every other one
+ * bumps through its own reserved span of arena_span bytes, which is also how
+ * a block is mapped back to its arena.
+ */
+typedef struct arena {
+    block_t *seg_list[SEG_LIST_COUNT]; // heads of the segregated free lists
+    // bit i is set exactly when seg_list[i] is non-empty, so find_fit can
+    // jump straight to the first usable class instead of walking empty
+    // buckets.
+    word_t seg_bitmap;
+    block_t *heap_start; // first block header, after the prologue
+    size_t dirty; // bytes freed into large blocks since the last purge
+#ifdef MM_THREADS
+    char *brk;   // end of the arena's heap, NULL if it grows with mem_sbrk
+    char *limit; // end of the arena's reserved span
+    pthread_mutex_t lock;
+#endif
+} arena_t;
+
+/**
+ * @brief The slab state of one thread.
+ *
+ * Without MM_THREADS there is a single cache, stored in the heap table next
+ * to the arena. With MM_THREADS every thread gets its own, carved from its
+ * home arena on its first malloc, so small requests only take an arena lock
+ * when a whole run is carved or released.
+ */
+typedef struct tcache {
+    block_t *runs[SLAB_CLASS_COUNT]; // partially used runs per slab class
+    word_t run_count[SLAB_CLASS_COUNT]; // live runs per slab class
+    word_t run_meta; // bytes of the live runs outside their slots
+    arena_t *home; // where this cache carves new runs and large blocks
+#ifdef MM_THREADS
+    // slots of our runs freed by other threads, linked through their
+    // payloads. Other threads push onto it with a CAS; the owner takes the
+    // whole list at once, so there is no ABA problem.
+    block_t *remote;
+    struct tcache *next; // next cache left behind by an exited thread
+#endif
+} tcache_t;
+
 /* Global variables */
 
-/** @brief Pointer to first block in the heap */
-static block_t *heap_start = NULL;
 // static block_t *free_list_head = NULL;
-static block_t *seg_list[15];
+#ifdef MM_THREADS
+// the arena this thread is working on, set by lock_arena, and this thread's
+// slab runs. initial-exec keeps the accesses plain loads, and never calls
+// back into malloc the way lazily allocated TLS would.
+static __thread arena_t *arena __attribute__((tls_model("initial-exec")));
+static __thread tcache_t *tcache __attribute__((tls_model("initial-exec")));
+// arena 0, which grows with mem_sbrk
+static arena_t *main_arena = NULL;
+// the reserved spans of arenas 1 to arena_count - 1, back to back
+static char *arena_base = NULL;
+static unsigned arena_count = 0;
+// round-robin cursor, for when the CPU id isn't available
+static unsigned next_arena = 0;
+// guards arena setup and the list of abandoned caches
+static pthread_mutex_t setup_mutex = PTHREAD_MUTEX_INITIALIZER;
+// serializes every call that changes memlib's state (mem_sbrk, mem_map and
+// friends), which memlib.c doesn't do on its own: they share its heap,
+// mapping and peak counters
+static pthread_mutex_t mem_mutex = PTHREAD_MUTEX_INITIALIZER;
+// hands a thread's cache to abandon_cache when the thread exits. It is
+// created once per process, however often mm_init runs.
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+static bool cache_key_ready = false;
+// caches of exited threads, reused by the next new threads
+static tcache_t *abandoned = NULL;
+#else
+// the arena and slab cache live at the very start of the heap (see mm_init),
+// so the class count doesn't eat into the global data budget.
+static arena_t *arena = NULL;
+static tcache_t *tcache = NULL;
+#endif
 
 /*
  *****************************************************************************
@@ -230,13 +480,14 @@ static word_t pack(size_t size, bool alloc, bool footer, bool prev_mini) {
  * @brief Extracts the size represented in a packed word.
  *
  * This function simply clears the lowest 4 bits of the word, as the heap
- * is 16-byte aligned.
+ * is 16-byte aligned. Free mini blocks store a list link there instead, and
+ * are always min_block_size bytes.
  *
  * @param[in] word
  * @return The size of the block represented by the word
  */
 static size_t extract_size(word_t word) {
-    return (word & size_mask);
+    return (word & mini_free_mask) ? min_block_size : (word & size_mask);
 }
 
 /**
@@ -449,51 +700,33 @@ static block_t *find_prev(block_t *block) {
     return footer_to_header(footerp);
 }
 
-// given a block_size, we find what bucket it should be in the seglist.
+/**
+ * @brief Maps a block size to the index of its segregated list.
+ *
+ * Sizes are counted in 16-byte units. The first 2^SEG_SUBCLASS_BITS units get
+ * one class each (index 0 is the mini block class); after that each power of
+ * two is cut into 2^SEG_SUBCLASS_BITS equal sub-classes. The power of two
+ * comes from one count-leading-zeros, and OR-ing in seg_sub_count pins the
+ * shift at zero for the linear range, so there are no branches besides the
+ * clamp into the last list (which compiles to a conditional move).
+ *
+ * @param[in] block_size A block size, a positive multiple of dsize
+ * @return The seg_list index, in [0, seg_list_count)
+ */
 int find_index(size_t block_size) {
-    // minimum size must be 16 I think?
-    // Edit later: This is in fact incorrect when I wrote this
-    // however, me being incorrect saved me time when the minimum size actually
-    // was supposed to be 16 insert michael scott shaking hands meme here
-
-    // 0 will be the designated index for our mini blocks
-
-    if (((1 << 4) <= block_size) && (block_size < (1 << 5)))
-        return 0;
-    else if (((1 << 5) <= block_size) && (block_size <= (1 << 6)))
-        return 1;
-    else if (((1 << 6) < block_size) && (block_size <= (1 << 7)))
-        return 2;
-    else if (((1 << 7) < block_size) && (block_size <= (1 << 8)))
-        return 3;
-    else if (((1 << 8) < block_size) && (block_size <= (1 << 9)))
-        return 4;
-    else if (((1 << 9) < block_size) && (block_size <= (1 << 10)))
-        return 5;
-    else if (((1 << 10) < block_size) && (block_size <= (1 << 11)))
-        return 6;
-    else if (((1 << 11) < block_size) && (block_size <= (1 << 12)))
-        return 7;
-    else if (((1 << 12) < block_size) && (block_size <= (1 << 13)))
-        return 8;
-    else if (((1 << 13) < block_size) && (block_size <= (1 << 14)))
-        return 9;
-    else if (((1 << 14) < block_size) && (block_size <= (1 << 15)))
-        return 10;
-    else if (((1 << 15) < block_size) && (block_size <= (1 << 16)))
-        return 11;
-    else if (((1 << 16) < block_size) && (block_size <= (1 << 17)))
-        return 12;
-    else if (((1 << 17) < block_size) && (block_size <= (1 << 18)))
-        return 13;
-    else {
-        return 14;
-    }
+    dbg_requires(block_size >= min_block_size);
+
+    size_t units = block_size / dsize;
+    int shift = (63 - __builtin_clzll(units | seg_sub_count)) -
+                SEG_SUBCLASS_BITS;
+    int index = shift * (int)seg_sub_count + (int)(units >> shift) - 1;
+
+    return (index < seg_list_count) ? index : seg_list_count - 1;
 }
 
 // if you can't figure out what this does I'll be very sad
 void print_heap() {
-    block_t *current_header = heap_start;
+    block_t *current_header = arena->heap_start;
     if (get_size(current_header) == 0)
         return;
     block_t *next_header = find_next(current_header);
@@ -536,7 +769,7 @@ body).list_pointers.next) assert(0); printf("Block %ld, size %ld, alloc %d\n",
 }*/
 
 void print_mini(int line) {
-    block_t *current_header = seg_list[0];
+    block_t *current_header = arena->seg_list[0];
     if (current_header == NULL) {
         printf("Mini list empty\n");
         return;
@@ -554,32 +787,52 @@ void print_mini(int line) {
     printf("\n");
 }
 
+/**
+ * @brief Returns the previous block in the mini free list.
+ * @param[in] block A free mini block on the mini list
+ * @return The previous block in the list, or NULL if `block` is the head
+ */
+static block_t *get_mini_prev(block_t *block) {
+    dbg_requires(block->header & mini_free_mask);
+    void *prev_payload = (void *)(block->header & size_mask);
+    return (prev_payload == NULL) ? NULL : payload_to_header(prev_payload);
+}
+
+/**
+ * @brief Points a free mini block's header at its list predecessor.
+ *
+ * The prev_alloc and prev_mini bits of the header are kept, the alloc bit is
+ * cleared and mini_free_mask is set.
+ *
+ * @param[out] block A free mini block
+ * @param[in] prev The previous block in the mini list, or NULL for the head
+ */
+static void set_mini_prev(block_t *block, block_t *prev) {
+    word_t link = (prev == NULL) ? 0 : (word_t)header_to_payload(prev);
+    block->header =
+        link | mini_free_mask | (block->header & (footer_mask | mini_mask));
+}
+
+// unlinks a free mini block in constant time using the prev link stored in
+// its header
 void remove_miniblock(block_t *to_find) {
-    // these blocks only have a next pointer
     dbg_requires(get_size(to_find) < 32);
 
-    // testing if first block is the one we need to remove
-    if (&(*seg_list[0]) == &(*to_find)) {
-        seg_list[0] = (to_find->body).mini_pointers.next;
-        return;
-    }
-
-    // search for where the block is
-    block_t *current = seg_list[0];
-    block_t *next = (current->body).mini_pointers.next;
+    block_t *prev = get_mini_prev(to_find);
+    block_t *next = (to_find->body).mini_pointers.next;
 
-    while (next != NULL) {
-        // removing next from list
-        if (&(*next) == &(*to_find)) {
-            (current->body).mini_pointers.next =
-                (next->body).mini_pointers.next;
-            return;
+    if (prev == NULL) {
+        arena->seg_list[0] = next;
+        if (next == NULL) {
+            arena->seg_bitmap &= ~(word_t)1;
         }
+    } else {
+        (prev->body).mini_pointers.next = next;
+    }
 
-        current = next;
-        next = (next->body).mini_pointers.next;
+    if (next != NULL) {
+        set_mini_prev(next, prev);
     }
-    printf("Remove block with address %ld unsuccessful.", (long)&(*to_find));
 }
 
 // removes the block from the free list
@@ -593,13 +846,14 @@ void remove_block(block_t *current_block) {
     }
 
     // if front and end of list
-    if ((&(*current_block) == &(*seg_list[index])) &&
+    if ((&(*current_block) == &(*arena->seg_list[index])) &&
         (((current_block->body).list_pointers.next) == NULL)) {
-        seg_list[index] = NULL;
+        arena->seg_list[index] = NULL;
+        arena->seg_bitmap &= ~((word_t)1 << index);
     }
     // if front of list
-    else if (&(*current_block) == &(*seg_list[index])) {
-        seg_list[index] = (current_block->body).list_pointers.next;
+    else if (&(*current_block) == &(*arena->seg_list[index])) {
+        arena->seg_list[index] = (current_block->body).list_pointers.next;
     }
     // end of list
     else if (((current_block->body).list_pointers.next) == NULL) {
@@ -618,8 +872,15 @@ void remove_block(block_t *current_block) {
 void add_miniblock(block_t *current_block) {
     dbg_requires(get_size(current_block) < 32);
 
-    (current_block->body).mini_pointers.next = seg_list[0];
-    seg_list[0] = current_block;
+    block_t *head = arena->seg_list[0];
+
+    (current_block->body).mini_pointers.next = head;
+    set_mini_prev(current_block, NULL);
+    if (head != NULL) {
+        set_mini_prev(head, current_block);
+    }
+    arena->seg_list[0] = current_block;
+    arena->seg_bitmap |= (word_t)1;
 }
 
 // adds a block to the front of the free list
@@ -632,13 +893,14 @@ void add_block(block_t *current_block) {
         return;
     }
 
-    if (seg_list[index] == NULL) {
+    if (arena->seg_list[index] == NULL) {
         (current_block->body).list_pointers.next = NULL;
-        seg_list[index] = current_block;
+        arena->seg_list[index] = current_block;
+        arena->seg_bitmap |= (word_t)1 << index;
     } else {
-        (seg_list[index]->body).list_pointers.prev = current_block;
-        (current_block->body).list_pointers.next = seg_list[index];
-        seg_list[index] = current_block;
+        (arena->seg_list[index]->body).list_pointers.prev = current_block;
+        (current_block->body).list_pointers.next = arena->seg_list[index];
+        arena->seg_list[index] = current_block;
     }
 }
 
@@ -740,6 +1002,67 @@ static block_t *coalesce_block(block_t *block) {
     }
 }
 
+// with MM_THREADS, serializes the calls into memlib; otherwise these do
+// nothing
+static void lock_memlib(void) {
+#ifdef MM_THREADS
+    pthread_mutex_lock(&mem_mutex);
+#endif
+}
+
+static void unlock_memlib(void) {
+#ifdef MM_THREADS
+    pthread_mutex_unlock(&mem_mutex);
+#endif
+}
+
+/**
+ * @brief Grows the current arena's heap by `size` bytes.
+ *
+ * Arena 0 grows with mem_sbrk; the other arenas of a threaded build bump
+ * through their reserved span instead.
+ *
+ * @param[in] size The number of bytes to add
+ * @return The start of the new space, or (void *)-1 if out of memory
+ */
+static void *arena_sbrk(size_t size) {
+#ifdef MM_THREADS
+    if (arena->brk != NULL) {
+        if (size > (size_t)(arena->limit - arena->brk)) {
+            return (void *)-1;
+        }
+        void *bp = arena->brk;
+        arena->brk += size;
+        return bp;
+    }
+#endif
+    lock_memlib();
+    void *bp = mem_sbrk((intptr_t)size);
+    unlock_memlib();
+    return bp;
+}
+
+/**
+ * @brief Shrinks the current arena's heap by `size` bytes.
+ *
+ * The counterpart of arena_sbrk. Arenas with a reserved span only move their
+ * break back, and discard the pages past it.
+ *
+ * @param[in] size The number of bytes to give back
+ */
+static void arena_trim(size_t size) {
+#ifdef MM_THREADS
+    if (arena->brk != NULL) {
+        arena->brk -= size;
+        mem_discard(arena->brk, size);
+        return;
+    }
+#endif
+    lock_memlib();
+    mem_sbrk(-(intptr_t)size);
+    unlock_memlib();
+}
+
 /**
  * @brief
  *
@@ -757,7 +1080,7 @@ static block_t *extend_heap(size_t size) {
 
     // Allocate an even number of words to maintain alignment
     size = round_up(size, dsize);
-    if ((bp = mem_sbrk(size)) == (void *)-1) {
+    if ((bp = arena_sbrk(size)) == (void *)-1) {
         return NULL;
     }
 
@@ -771,7 +1094,7 @@ static block_t *extend_heap(size_t size) {
 
     // Create new epilogue header
     block_t *block_next = find_next(block);
-    write_epilogue(block_next, false, false);
+    write_epilogue(block_next, false, is_mini(block));
 
     // Coalesce in case the previous block was free
     block = coalesce_block(block);
@@ -825,19 +1148,20 @@ static void split_block(block_t *block, size_t asize) {
 
 static block_t *find_mini() {
     // seg_list[0] is the first available free miniblock.
-    return seg_list[0];
+    return arena->seg_list[0];
 }
 
 /**
- * @brief
+ * @brief Finds a free block of at least `asize` bytes.
  *
- * <What does this function do?>
- * <What are the function's arguments?>
- * <What is the function's return value?>
- * <Are there any preconditions or postconditions?>
+ * Only the bucket `asize` maps to can hold blocks that are too small, so that
+ * bucket is searched first-fit. Every block in a higher bucket is guaranteed
+ * to fit, so after that we take the head of the first non-empty bucket above,
+ * which one count-trailing-zeros on seg_bitmap finds without touching the
+ * empty buckets in between.
  *
- * @param[in] asize
- * @return
+ * @param[in] asize The adjusted block size being requested
+ * @return A free block of at least `asize` bytes, or NULL if there is none
  */
 static block_t *find_fit(size_t asize) {
     block_t *block;
@@ -847,222 +1171,760 @@ static block_t *find_fit(size_t asize) {
         block = find_mini();
         if (block != NULL) {
             return block;
-        } else {
-            index = 1;
         }
-    }
-
-    for (int i = index; i < 15; i++) {
-        for (block = seg_list[i]; (block != NULL) && (get_size(block) > 0);
+    } else {
+        for (block = arena->seg_list[index]; block != NULL;
              block = (block->body).list_pointers.next) {
-
-            if (!(get_alloc(block)) && (asize <= get_size(block))) {
+            if (asize <= get_size(block)) {
                 return block;
             }
         }
     }
 
-    return NULL; // no fit found
-}
-
-bool check_size(block_t *current_header) {
-    return true;
-    // I have no idea how to compare the addresses in mem_heap_lo() and
-    return (&*(char *)mem_heap_lo() < &*(char *)current_header) &&
-           (&*(char *)current_header < &*(char *)mem_heap_hi());
-    // I can either case mem_heap_lo() to a char * or I can
-    // cast current_header to a void* and compare it that way
-}
-
-bool compare_sizes(block_t *current_header, word_t *current_footer) {
-    // compare the size in header and footer to be the same
-    size_t header_size = get_size(current_header);
-    size_t footer_size = extract_size(*current_footer);
-
-    return header_size == footer_size;
-}
-
-bool compare_alloc(block_t *current_header, word_t *current_footer) {
-    // compare the alloc in header and footer to be the same
-    bool header_alloc = get_alloc(current_header);
-    bool footer_alloc = extract_alloc(*current_footer);
-
-    return header_alloc == footer_alloc;
-}
-
-// I have no idea if this is correct either
-bool check_alignment(block_t *current_header) {
-    void *current_payload = header_to_payload(current_header);
-    return ((long)&current_payload % 16) == 0;
-}
-
-bool check_circularity(block_t *current_block) {
-    // end of list
-    if (((current_block->body).list_pointers.next) == NULL) {
-        return true;
-    } else {
-        block_t *next_block = (current_block->body).list_pointers.next;
-        return (next_block->body).list_pointers.prev == current_block;
-    }
-}
-bool check_forward_back(block_t *current_block, int line) {
-    block_t *current_header = heap_start;
-    bool cur_alloc = get_alloc(current_header);
-    bool prev_alloc = false;
-    block_t *next_header = find_next(current_header);
-
-    while (get_size(next_header) != 0) {
-        prev_alloc = get_before_alloc(next_header);
-
-        if (cur_alloc != prev_alloc) {
-            printf("Error on line %d, previous alloc doesn't match cur_alloc\n",
-                   line);
-            return false;
-        }
-
-        current_header = next_header;
-        next_header = find_next(next_header);
-        cur_alloc = get_alloc(current_header);
+    // buckets strictly above index
+    word_t bigger = arena->seg_bitmap & (~(word_t)1 << index);
+    if (bigger == 0) {
+        return NULL; // no fit found
     }
-    return true;
+    return arena->seg_list[__builtin_ctzll(bigger)];
 }
 
 /**
- * @brief
+ * @brief Allocates a boundary-tag block of `asize` bytes.
  *
- * <What does this function do?>
- * <What are the function's arguments?>
- * <What is the function's return value?>
- * <Are there any preconditions or postconditions?>
+ * Searches the segregated lists, extends the heap by at least chunksize if
+ * nothing fits, splits off any excess and updates the successor's
+ * prev_alloc/prev_mini bits.
  *
- * @param[in] line
- * @return
+ * @param[in] asize The adjusted block size, a multiple of dsize
+ * @return The allocated block, or NULL if the heap could not be extended
  */
-bool mm_checkheap(int line) {
-    // print_heap();
-    // print_mini(line);
-    // printf("\n\n");
-    // return check_forward_back(heap_start, line);
+static block_t *alloc_block(size_t asize) {
+    size_t extendsize; // Amount to extend heap if no fit is found
+    block_t *block;
 
-    // imagine actually checking the heap
-    return true;
+    // Search the free list for a fit
+    block = find_fit(asize);
 
-    // first check: the heap must exist lol
-    if (heap_start == NULL) {
-        printf("Error on line %d, heap is not initialized.\n", line);
-        return false;
-    } else if (mem_heapsize() == 0)
-        return true;
-    // second check: check each block's address alignment
-    block_t *current_header = heap_start;
-    block_t *next_header = find_next(current_header);
-    word_t *current_footer = header_to_footer(current_header);
+    // If no fit is found, request more memory, and then and place the block
+    if (block == NULL) {
+        // Always request at least chunksize
+        extendsize = max(asize, chunksize);
+        block = extend_heap(extendsize);
+        // extend_heap returns an error
+        if (block == NULL) {
+            return NULL;
+        }
+    }
 
-    // we're also counting the number of free blocks while we're at it
-    size_t num_free_blocks = 0;
-    while (get_size(next_header) != 0) {
-        current_footer = header_to_footer(current_header);
+    // The block should be marked as free
+    dbg_assert(!get_alloc(block));
 
-        if (get_alloc(current_header) == false)
-            num_free_blocks++;
+    // Mark block as allocated
+    size_t block_size = get_size(block);
+    remove_block(block);
+    // conceptually, the block before must always be allocated
+    write_block(block, block_size, true, true, get_before_mini(block));
 
-        // check if epilogue/footer block exists
-        if (current_footer == NULL) {
-            printf(
-                "Error on line %d, footer does not exist for given header.\n",
-                line);
-            return false;
-        }
+    // Try to split the block if too large
+    split_block(block, asize);
 
-        if (!compare_sizes(current_header, current_footer)) {
-            printf("Error on line %d, header size does not match footer\n",
-                   line);
-            printf("header size: %ld, footer size: %ld\n",
-                   get_size(current_header), extract_size(*current_footer));
-            return false;
-        }
+    block_t *next = find_next(block);
 
-        if (!compare_alloc(current_header, current_footer)) {
-            printf("Error on line %d, header alloc does not match footer\n",
-                   line);
-            return false;
+    bool is_mini_block = is_mini(block);
+    // updating the block after to change alloc status
+    if (get_size(next) > 0) {
+        if (get_alloc(next) == 0) {
+            remove_block(next);
         }
-
-        if (!check_size(current_header)) {
-            printf("Error on line %d, part of memory is not on heap.\n", line);
-            return false;
+        write_block(next, get_size(next), get_alloc(next), true, is_mini_block);
+        if (get_alloc(next) == 0) {
+            add_block(next);
         }
+    } else {
+        dbg_assert(get_size(next) == 0);
+        write_epilogue(next, true, is_mini_block);
+    }
 
-        if (!check_alignment(current_header)) {
-            printf("Error on line %d, memory is not 16 byte aligned.\n", line);
-            return false;
-        }
+    return block;
+}
 
-        current_header = next_header;
-        next_header = find_next(next_header);
+/**
+ * @brief Returns the number of bytes in the current arena's heap.
+ */
+static size_t arena_heapsize(void) {
+#ifdef MM_THREADS
+    if (arena->brk != NULL) {
+        return (size_t)(arena->brk - (char *)arena->heap_start);
     }
+#endif
+    return (size_t)((char *)mem_heap_hi() + 1 - (char *)arena->heap_start);
+}
 
-    // last element in heap:
-    current_footer = header_to_footer(current_header);
-    if (get_alloc(current_header) == false)
-        num_free_blocks++;
-    if (current_footer == NULL) {
-        printf("Error on line %d, footer does not exist for given header.\n",
-               line);
-        return false;
+/**
+ * @brief Shrinks the current arena's heap if it ends in a free block of at
+ * least trim_threshold bytes, leaving chunksize bytes of it.
+ */
+static void trim_heap(void) {
+    block_t *epilogue = payload_to_header((char *)arena->heap_start +
+                                          arena_heapsize());
+    if (trim_threshold == 0 || get_before_alloc(epilogue)) {
+        return;
     }
 
-    if (!compare_sizes(current_header, current_footer)) {
-        printf("Error on line %d, header size does not match footer\n", line);
-        return false;
+    block_t *block = find_prev(epilogue);
+    size_t size = get_size(block);
+    if (size < trim_threshold || size <= chunksize) {
+        return;
     }
 
-    if (!compare_alloc(current_header, current_footer)) {
-        printf("Error on line %d, header alloc does not match footer\n", line);
-        return false;
-    }
+    remove_block(block);
+    // shrink first, write_epilogue checks that it ends the heap
+    arena_trim(size - chunksize);
+    write_block(block, chunksize, false, get_before_alloc(block),
+                get_before_mini(block));
+    add_block(block);
+    write_epilogue(find_next(block), false, false);
+}
 
-    if (!check_size(current_header)) {
-        printf("Error on line %d, part of memory is not on heap.\n", line);
-        return false;
-    }
+/**
+ * @brief Gives the memory of large free blocks in the current arena back to
+ * the system.
+ *
+ * The heap is trimmed first. Then the pages of every free block of at least
+ * release_threshold bytes are discarded; the header, list links and footer
+ * of each block stay in place.
+ */
+static void purge_arena(void) {
+    trim_heap();
 
-    if (!check_alignment(current_header)) {
-        printf("Error on line %d, memory is not 16 byte aligned.\n", line);
-        return false;
+    word_t lists = 0;
+    if (release_threshold != 0) {
+        lists = arena->seg_bitmap &
+                (~(word_t)0 << find_index(release_threshold));
     }
+    while (lists != 0) {
+        int index = __builtin_ctzll(lists);
+        lists &= lists - 1;
+        for (block_t *block = arena->seg_list[index]; block != NULL;
+             block = (block->body).list_pointers.next) {
+            size_t size = get_size(block);
+            if (size >= release_threshold) {
+                mem_discard((char *)block + 3 * wsize, size - 4 * wsize);
+            }
+        }
+    }
+    arena->dirty = 0;
+}
+
+/**
+ * @brief Accounts for bytes freed into a large free block, and gives memory
+ * back to the system once enough has piled up.
+ *
+ * A large block is often reused right away (think of an array that keeps
+ * being realloc'ed), and handing its pages back would only make the next
+ * user fault every one of them in again. So bytes freed into a block that
+ * could be trimmed or released only count as dirty at first, and once the
+ * dirty bytes pass 1/purge_ratio of the heap, purge_arena deals with all
+ * large free blocks at once.
+ *
+ * @param[in] block A free block, already coalesced
+ * @param[in] freed_size The number of bytes that were just freed into it
+ */
+static void release_block(block_t *block, size_t freed_size) {
+    size_t size = get_size(block);
+    bool trim = trim_threshold != 0 && size >= trim_threshold &&
+                get_size(find_next(block)) == 0;
+    bool release = release_threshold != 0 && size >= release_threshold;
+
+    if (trim || release) {
+        arena->dirty += freed_size;
+        if (arena->dirty > arena_heapsize() / purge_ratio) {
+            purge_arena();
+        }
+    }
+}
+
+/**
+ * @brief Frees an allocated boundary-tag block and coalesces it.
+ *
+ * Also updates the successor's prev_alloc/prev_mini bits, and gives large
+ * free blocks back to the system (see release_block).
+ *
+ * @param[in] block An allocated block (not a slab slot)
+ */
+static void free_block(block_t *block) {
+    size_t size = get_size(block);
+    bool prev_alloc = get_before_alloc(block);
+
+    // The block should be marked as allocated
+    dbg_assert(get_alloc(block));
+
+    // Mark the block as free
+    write_block(block, size, false, prev_alloc, get_before_mini(block));
+    add_block(block);
+
+    // Try to coalesce the block with its neighbors
+    block = coalesce_block(block);
+
+    block_t *next = find_next(block);
+    if (get_size(next) > 0) {
+        if (get_alloc(next) == 0) {
+            remove_block(next);
+        }
+        write_block(next, get_size(next), get_alloc(next), false,
+                    is_mini(block));
+        if (get_alloc(next) == 0) {
+            add_block(next);
+        }
+    } else {
+        write_epilogue(next, false, is_mini(block));
+    }
+
+    release_block(block, size);
+}
+
+// with MM_THREADS, locks an arena and makes it the one the heap functions
+// above work on; otherwise there is only one arena and one thread, and these
+// do nothing
+static void lock_arena(arena_t *a) {
+#ifdef MM_THREADS
+    pthread_mutex_lock(&a->lock);
+    arena = a;
+#endif
+}
+
+static void unlock_arena(void) {
+#ifdef MM_THREADS
+    pthread_mutex_unlock(&arena->lock);
+#endif
+}
+
+/**
+ * @brief Returns the arena a heap address belongs to.
+ * @param[in] p An address inside some block
+ * @return Its arena
+ */
+static arena_t *arena_of(void *p) {
+#ifdef MM_THREADS
+    size_t offset = (size_t)((char *)p - arena_base);
+    if (offset < (arena_count - 1) * arena_span) {
+        return (arena_t *)(arena_base + offset / arena_span * arena_span);
+    }
+    return main_arena;
+#else
+    return arena;
+#endif
+}
+
+/**
+ * @brief Returns whether a block header belongs to a slot in a slab run.
+ *
+ * Slot headers are the only ones with both alloc_mask and mini_free_mask set.
+ *
+ * @param[in] block
+ * @return true if `block` is a slab slot
+ */
+static bool is_slab_slot(block_t *block) {
+    word_t tag = alloc_mask | mini_free_mask;
+    return (block->header & ~size_mask) == tag;
+}
+
+/**
+ * @brief Returns the run a slab slot belongs to.
+ * @param[in] slot A slab slot
+ * @return The run block holding the slot
+ */
+static block_t *slot_to_run(block_t *slot) {
+    dbg_requires(is_slab_slot(slot));
+    return payload_to_header((void *)(slot->header & size_mask));
+}
+
+/**
+ * @brief Returns the i-th slot of a run.
+ * @param[in] run A slab run
+ * @param[in] i The slot index, less than the run's capacity
+ * @return The slot (its header word)
+ */
+static block_t *run_slot(block_t *run, size_t i) {
+    return (block_t *)((run->body).run.slots + i * (run->body).run.slot_size);
+}
+
+/**
+ * @brief Returns the list head for the slab class of the given slot size.
+ * @param[in] slot_size A slab slot size, a multiple of dsize
+ * @return The address of this thread's list head for that class
+ */
+static block_t **run_head(size_t slot_size) {
+    return &tcache->runs[slot_size / dsize - 1];
+}
+
+// pushes a run onto the front of its class's list of partially used runs
+static void link_run(block_t *run) {
+    block_t **head = run_head((run->body).run.slot_size);
+
+    (run->body).run.prev = NULL;
+    (run->body).run.next = *head;
+    if (*head != NULL) {
+        ((*head)->body).run.prev = run;
+    }
+    *head = run;
+}
+
+// takes a run off its class's list of partially used runs
+static void unlink_run(block_t *run) {
+    block_t *prev = (run->body).run.prev;
+    block_t *next = (run->body).run.next;
+
+    if (prev == NULL) {
+        *run_head((run->body).run.slot_size) = next;
+    } else {
+        (prev->body).run.next = next;
+    }
+    if (next != NULL) {
+        (next->body).run.prev = prev;
+    }
+}
+
+/**
+ * @brief Carves a new slab run for `slot_size`-byte slots out of the heap.
+ *
+ * The run is an ordinary allocated block, sized for twice as many slots as
+ * the class's previous run and capped at run_size. All of its slot headers
+ * are written here, once, so handing out and taking back slots later only
+ * touches the run's free bitmap.
+ *
+ * @param[in] slot_size The slot size, a multiple of dsize up to slab_max_size
+ * @return The new run, already on its class's list, or NULL if out of memory
+ */
+static block_t *new_run(size_t slot_size) {
+    word_t *count = &tcache->run_count[slot_size / dsize - 1];
+    size_t slots = run_min_slots << (*count < 16 ? *count : 16);
+    size_t size = offsetof(block_t, body.run.slots) + slots * slot_size;
+    lock_arena(tcache->home);
+    block_t *run = alloc_block(size < run_size ? size : run_size);
+    unlock_arena();
+    if (run == NULL) {
+        return NULL;
+    }
+    (*count)++;
+#ifdef MM_THREADS
+    (run->body).run.owner = tcache;
+#endif
+
+    size_t capacity =
+        (get_size(run) - offsetof(block_t, body.run.slots)) / slot_size;
+    (run->body).run.slot_size = slot_size;
+    (run->body).run.capacity = capacity;
+    (run->body).run.free_count = capacity;
+    tcache->run_meta += get_size(run) - capacity * slot_size;
+
+    for (size_t w = 0; w < RUN_MAP_WORDS; w++) {
+        size_t lo = 64 * w;
+        word_t bits = 0;
+        if (capacity >= lo + 64) {
+            bits = ~(word_t)0;
+        } else if (capacity > lo) {
+            bits = ((word_t)1 << (capacity - lo)) - 1;
+        }
+        (run->body).run.free_map[w] = bits;
+    }
+
+    word_t tag = (word_t)header_to_payload(run) | alloc_mask | mini_free_mask;
+    for (size_t i = 0; i < capacity; i++) {
+        run_slot(run, i)->header = tag;
+    }
+
+    link_run(run);
+    return run;
+}
+
+/**
+ * @brief Returns a slot to its run in this thread's cache.
+ *
+ * A full run goes back on its class's list. A run that becomes completely
+ * free is released to the heap, unless it is the only run left on the list,
+ * so a class hovering around a run boundary doesn't create and destroy runs
+ * on every call.
+ *
+ * @param[in] run The run holding `slot`, owned by this thread's cache
+ * @param[in] slot An allocated slab slot
+ */
+static void return_slot(block_t *run, block_t *slot) {
+    size_t i = (size_t)((char *)slot - (run->body).run.slots) /
+               (run->body).run.slot_size;
+
+    (run->body).run.free_map[i / 64] |= (word_t)1 << (i % 64);
+    (run->body).run.free_count++;
+
+    if ((run->body).run.free_count == 1) {
+        link_run(run);
+    } else if ((run->body).run.free_count == (run->body).run.capacity &&
+               ((run->body).run.prev != NULL ||
+                (run->body).run.next != NULL)) {
+        unlink_run(run);
+        tcache->run_count[(run->body).run.slot_size / dsize - 1]--;
+        tcache->run_meta -= get_size(run) - (run->body).run.capacity *
+                                                (run->body).run.slot_size;
+        lock_arena(arena_of(run));
+        free_block(run);
+        unlock_arena();
+    }
+}
+
+#ifdef MM_THREADS
+/**
+ * @brief Takes back the slots other threads freed from this thread's runs.
+ *
+ * The whole queue is swapped out in one step, so this batch is ours alone
+ * while remote frees keep pushing onto a fresh list.
+ */
+static void drain_remote(void) {
+    block_t *slot = __atomic_exchange_n(&tcache->remote, NULL,
+                                        __ATOMIC_ACQUIRE);
+    while (slot != NULL) {
+        block_t *next = (slot->body).mini_pointers.next;
+        return_slot(slot_to_run(slot), slot);
+        slot = next;
+    }
+}
+#endif
+
+/**
+ * @brief Allocates a small block from its class's slab runs.
+ *
+ * Takes the lowest free slot of the first partially used run, carving a new
+ * run when the class has none. A run that fills up leaves the list.
+ *
+ * @param[in] asize The adjusted block size, at most slab_max_size
+ * @return A pointer to the slot's payload, or NULL if out of memory
+ */
+static void *slab_alloc(size_t asize) {
+    dbg_requires(asize <= slab_max_size);
+
+#ifdef MM_THREADS
+    if (__atomic_load_n(&tcache->remote, __ATOMIC_RELAXED) != NULL) {
+        drain_remote();
+    }
+#endif
+
+    block_t *run = *run_head(asize);
+    if (run == NULL) {
+        run = new_run(asize);
+        if (run == NULL) {
+            return NULL;
+        }
+    }
+
+    size_t w = 0;
+    while ((run->body).run.free_map[w] == 0) {
+        w++;
+    }
+    word_t bits = (run->body).run.free_map[w];
+    size_t i = 64 * w + (size_t)__builtin_ctzll(bits);
+    (run->body).run.free_map[w] = bits & (bits - 1);
+
+    (run->body).run.free_count--;
+    if ((run->body).run.free_count == 0) {
+        unlink_run(run);
+    }
+
+    return header_to_payload(run_slot(run, i));
+}
+
+/**
+ * @brief Frees a slab slot.
+ *
+ * With MM_THREADS, a slot of another thread's run is pushed onto that
+ * thread's remote queue instead, since only the owner touches a run's
+ * bitmap and lists.
+ *
+ * @param[in] slot An allocated slab slot
+ */
+static void slab_free(block_t *slot) {
+    block_t *run = slot_to_run(slot);
+
+#ifdef MM_THREADS
+    tcache_t *owner = (run->body).run.owner;
+    if (owner != tcache) {
+        block_t *head = __atomic_load_n(&owner->remote, __ATOMIC_RELAXED);
+        do {
+            (slot->body).mini_pointers.next = head;
+        } while (!__atomic_compare_exchange_n(&owner->remote, &head, slot,
+                                              true, __ATOMIC_RELEASE,
+                                              __ATOMIC_RELAXED));
+        return;
+    }
+#endif
+
+    return_slot(run, slot);
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ *                        MAPPED BLOCKS
+ * ---------------------------------------------------------------------------
+ */
+
+/**
+ * @brief Returns whether a block has a mapping of its own.
+ * @param[in] block An allocated block
+ */
+static bool is_mapped(block_t *block) {
+    return (block->header & ~size_mask) == mapped_tag;
+}
+
+/**
+ * @brief Returns the length of a mapped block's mapping.
+ *
+ * get_size can't be used, since mapped_tag includes mini_free_mask.
+ *
+ * @param[in] block A mapped block
+ */
+static size_t get_map_length(block_t *block) {
+    return block->header & size_mask;
+}
+
+/**
+ * @brief Returns the mapping length a payload of `size` bytes needs.
+ *
+ * The first word of the mapping is unused, so that the payload after the
+ * header is 16-byte aligned like everywhere else.
+ */
+static size_t map_length(size_t size) {
+    return round_up(size + dsize, mem_pagesize());
+}
+
+/**
+ * @brief Allocates a block with a mapping of its own.
+ *
+ * The header holds the length of the mapping (a multiple of the page size)
+ * and mapped_tag. There is no footer, and no neighbour ever looks at it.
+ *
+ * @param[in] size The requested payload size
+ * @return The payload, or NULL if out of memory
+ */
+static void *map_alloc(size_t size) {
+    size_t len = map_length(size);
+    if (len < size) {
+        return NULL; // size is close to SIZE_MAX
+    }
+
+    lock_memlib();
+    char *start = mem_map(len);
+    unlock_memlib();
+    if (start == NULL) {
+        return NULL;
+    }
+
+    block_t *block = (block_t *)(start + wsize);
+    block->header = len | mapped_tag;
+    return header_to_payload(block);
+}
+
+/**
+ * @brief Frees a mapped block by unmapping it.
+ * @param[in] block A mapped block
+ */
+static void map_free(block_t *block) {
+    dbg_requires(is_mapped(block));
+
+    lock_memlib();
+    mem_unmap((char *)block - wsize, get_map_length(block));
+    unlock_memlib();
+}
+
+/**
+ * @brief Resizes a mapped block with mem_remap, which moves the pages
+ * instead of copying the payload.
+ *
+ * @param[in] block A mapped block
+ * @param[in] size The new payload size
+ * @return The (possibly moved) payload, or NULL if out of memory, in which
+ *         case the block is unchanged
+ */
+static void *map_realloc(block_t *block, size_t size) {
+    dbg_requires(is_mapped(block));
+
+    size_t len = map_length(size);
+    if (len < size) {
+        return NULL;
+    }
+    if (len == get_map_length(block)) {
+        return header_to_payload(block);
+    }
+
+    lock_memlib();
+    char *start = mem_remap((char *)block - wsize, get_map_length(block), len);
+    unlock_memlib();
+    if (start == NULL) {
+        return NULL;
+    }
+
+    block = (block_t *)(start + wsize);
+    block->header = len | mapped_tag;
+    return header_to_payload(block);
+}
+
+// checks that a block header lies inside the current arena's heap, before
+// its epilogue
+bool check_size(block_t *current_header, block_t *epilogue) {
+    return (char *)arena->heap_start <= (char *)current_header &&
+           (char *)current_header < (char *)epilogue;
+}
 
-    // check coalescing: no consecutive free blocks in the heap
-    current_header = heap_start;
-    next_header = find_next(current_header);
+bool check_circularity(block_t *current_block) {
+    // end of list
+    if (((current_block->body).list_pointers.next) == NULL) {
+        return true;
+    } else {
+        block_t *next_block = (current_block->body).list_pointers.next;
+        return (next_block->body).list_pointers.prev == current_block;
+    }
+}
 
-    // special case: one block on heap
-    if (get_size(next_header) == 0)
+/**
+ * @brief Checks the current arena's heap and free lists for consistency.
+ *
+ * Walks every block from the prologue to the epilogue, checking that each
+ * lies on the heap with an aligned payload, that its prev_alloc and prev_mini
+ * bits describe the block before it, that no two free blocks sit next to
+ * each other and that free blocks (other than mini ones, whose footer word
+ * is their list link) have a matching footer. Then walks every segregated
+ * list, checking that seg_bitmap marks exactly the non-empty ones, that the
+ * lists are doubly linked, and that they hold exactly the free blocks of the
+ * heap, each in the list for its size.
+ *
+ * @param[in] line The line the check was called from, for the messages
+ * @return true if the heap is consistent, false (after printing what is
+ *         wrong) otherwise
+ */
+bool mm_checkheap(int line) {
+    // first check: the heap must exist lol
+    if (arena == NULL) {
+        printf("Error on line %d, heap is not initialized.\n", line);
+        return false;
+    } else if (mem_heapsize() == 0)
         return true;
 
-    block_t *end_checker = find_next(next_header);
+    word_t prologue = *find_prev_footer(arena->heap_start);
+    if (extract_size(prologue) != 0 || !extract_alloc(prologue)) {
+        printf("Error on line %d, bad prologue.\n", line);
+        return false;
+    }
 
-    while (get_size(end_checker) != 0) {
-        bool cur_alloc = get_alloc(current_header);
-        bool next_alloc = get_alloc(next_header);
+    block_t *epilogue =
+        (block_t *)((char *)arena->heap_start + arena_heapsize() - wsize);
 
-        if ((cur_alloc == false) && (next_alloc == false)) {
-            printf("Error on line %d, two free blocks together.\n", line);
+    // walk the heap, counting the free blocks while we're at it. This runs
+    // before and after every call in mdriver-dbg, so each header is only
+    // decoded once.
+    size_t num_free_blocks = 0;
+    bool prev_alloc = true;
+    bool prev_mini = false;
+    block_t *current_header = arena->heap_start;
+    while (current_header < epilogue) {
+        word_t header = current_header->header;
+        size_t size = extract_size(header);
+        bool alloc = extract_alloc(header);
+
+        if (size == 0 || (uintptr_t)current_header % dsize != wsize) {
+            printf("Error on line %d, block at %p is empty or its payload is "
+                   "not 16 byte aligned.\n",
+                   line, (void *)current_header);
             return false;
         }
 
-        current_header = next_header;
-        next_header = end_checker;
-        end_checker = find_next(end_checker);
+        if (extract_before_alloc(header) != prev_alloc ||
+            extract_before_mini(header) != prev_mini) {
+            printf("Error on line %d, prev alloc/mini bits out of sync at "
+                   "%p.\n",
+                   line, (void *)current_header);
+            return false;
+        }
+
+        if (!alloc) {
+            num_free_blocks++;
+
+            if (!prev_alloc) {
+                printf("Error on line %d, two free blocks together.\n", line);
+                return false;
+            }
+
+            // a free mini block's footer word is its list link
+            word_t footer =
+                *(word_t *)((char *)current_header + size - wsize);
+            if (size > min_block_size &&
+                (extract_size(footer) != size || extract_alloc(footer))) {
+                printf("Error on line %d, header does not match footer\n",
+                       line);
+                return false;
+            }
+        }
+
+        prev_alloc = alloc;
+        prev_mini = size == min_block_size;
+        current_header = (block_t *)((char *)current_header + size);
+    }
+
+    // the epilogue must end the heap and know what is before it
+    if (current_header != epilogue || get_size(epilogue) != 0 ||
+        !get_alloc(epilogue) || get_before_alloc(epilogue) != prev_alloc ||
+        get_before_mini(epilogue) != prev_mini) {
+        printf("Error on line %d, part of memory is not on heap, or bad "
+               "epilogue.\n",
+               line);
+        return false;
     }
 
     block_t *seg_list_start = NULL;
     // we will compare this to the number of free blocks on the heap
     size_t counter = 0;
-    for (int i = 0; i < 15; i++) {
-        seg_list_start = seg_list[i];
+    for (int i = 0; i < seg_list_count; i++) {
+        seg_list_start = arena->seg_list[i];
+        if ((seg_list_start != NULL) != (bool)((arena->seg_bitmap >> i) & 1)) {
+            printf("Error on line %d, bitmap out of sync for bucket %d.\n",
+                   line, i);
+            return false;
+        }
         while (seg_list_start != NULL) {
             counter++;
+            if (counter > num_free_blocks) {
+                printf("Error on line %d, more blocks on the free lists than "
+                       "free blocks on the heap.\n",
+                       line);
+                return false;
+            }
+
+            if (!check_size(seg_list_start, epilogue) ||
+                get_alloc(seg_list_start)) {
+                printf("Error on line %d, free list holds %p, which is not a "
+                       "free block.\n",
+                       line, (void *)seg_list_start);
+                return false;
+            }
+
+            if ((i == 0) != (bool)(seg_list_start->header & mini_free_mask)) {
+                printf("Error on line %d, mini block in the wrong list.\n",
+                       line);
+                return false;
+            }
+
+            if (i == 0) {
+                // the mini list keeps its prev link in the header, and only
+                // the head has none
+                block_t *next = (seg_list_start->body).mini_pointers.next;
+                if ((seg_list_start == arena->seg_list[0]) !=
+                        (get_mini_prev(seg_list_start) == NULL) ||
+                    (next != NULL && get_mini_prev(next) != seg_list_start)) {
+                    printf("Error on line %d, mini list not doubly linked "
+                           "properly.\n",
+                           line);
+                    return false;
+                }
+                seg_list_start = next;
+                continue;
+            }
 
             if (!check_circularity(seg_list_start)) {
                 printf(
@@ -1089,22 +1951,14 @@ bool mm_checkheap(int line) {
 }
 
 /**
- * @brief
+ * @brief Lays out an empty heap in an arena and gives it its first chunk.
  *
- * <What does this function do?>
- * <What are the function's arguments?>
- * <What is the function's return value?>
- * <Are there any preconditions or postconditions?>
- *
- * @return
+ * @param[in] a The arena, whose chunk source is already set up
+ * @param[in] start Where the heap begins, right after the arena's table
+ * @return true on success, false if out of memory
  */
-bool mm_init(void) {
-    // Create the initial empty heap
-    word_t *start = (word_t *)(mem_sbrk(2 * wsize));
-
-    if (start == (void *)-1) {
-        return false;
-    }
+static bool init_arena(arena_t *a, word_t *start) {
+    arena = a;
 
     /*
      * TODO: delete or replace this comment once you've thought about it.
@@ -1117,19 +1971,331 @@ bool mm_init(void) {
     start[1] = pack(0, true, true, false); // Heap epilogue (block header)
 
     // Heap starts with first "block header", currently the epilogue
-    heap_start = (block_t *)&(start[1]);
+    arena->heap_start = (block_t *)&(start[1]);
     // free_list_head = NULL;
-    for (int i = 0; i < 15; i++) {
-        seg_list[i] = NULL;
+    for (int i = 0; i < seg_list_count; i++) {
+        arena->seg_list[i] = NULL;
     }
-    seg_list[0] = NULL;
+    arena->seg_bitmap = 0;
+    arena->dirty = 0;
 
     // Extend the empty heap with a free block of chunksize bytes
-    if (extend_heap(chunksize) == NULL) {
+    return extend_heap(chunksize) != NULL;
+}
+
+#ifdef MM_THREADS
+/**
+ * @brief Returns the i-th arena.
+ * @param[in] i An arena index, less than arena_count
+ * @return The arena
+ */
+static arena_t *arena_at(unsigned i) {
+    if (i == 0) {
+        return main_arena;
+    }
+    return (arena_t *)(arena_base + (i - 1) * arena_span);
+}
+
+/**
+ * @brief Reserves and lays out arenas 1 to arena_count - 1.
+ *
+ * There is one arena per online CPU, up to MM_ARENAS, unless the MM_ARENAS
+ * environment variable says otherwise. If the address space can't be
+ * reserved, arena 0 carries on alone. The space is reserved by the first
+ * call only; later calls reuse it, so re-initializing doesn't leak it.
+ *
+ * @param[in] table_size The size of an arena's table, padded to dsize
+ * @return true on success, false if an arena couldn't get its first chunk
+ */
+static bool add_arenas(size_t table_size) {
+    if (arena_base != NULL) {
+        // reserved by an earlier mm_init: give the old heaps' pages back
+        // and lay the same arenas out again
+        madvise(arena_base, (arena_count - 1) * arena_span, MADV_DONTNEED);
+    } else {
+        const char *env = getenv("MM_ARENAS");
+        long want = (env != NULL) ? atol(env) : sysconf(_SC_NPROCESSORS_ONLN);
+        if (want > MM_ARENAS) {
+            want = MM_ARENAS;
+        }
+
+        arena_count = 1;
+        if (want <= 1) {
+            return true;
+        }
+
+        size_t length = (size_t)(want - 1) * arena_span;
+        void *base = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (base == MAP_FAILED) {
+            return true;
+        }
+
+        arena_base = base;
+        arena_count = (unsigned)want;
+    }
+
+    for (unsigned i = 1; i < arena_count; i++) {
+        arena_t *a = arena_at(i);
+        // the table is followed by the prologue and the initial epilogue,
+        // just like in the mem_sbrk'd heap of arena 0
+        a->brk = (char *)a + table_size + 2 * wsize;
+        a->limit = (char *)a + arena_span;
+        pthread_mutex_init(&a->lock, NULL);
+        if (!init_arena(a, (word_t *)((char *)a + table_size))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Picks the home arena of a new thread.
+ *
+ * Threads go round-robin over the arenas, or, with MM_ARENA_POLICY=cpu, to
+ * the arena of the CPU they start on. Must be called with setup_mutex held.
+ *
+ * @return The arena
+ */
+static arena_t *pick_arena(void) {
+    const char *policy = getenv("MM_ARENA_POLICY");
+    int cpu = -1;
+    if (policy != NULL && strcmp(policy, "cpu") == 0) {
+        cpu = sched_getcpu();
+    }
+
+    unsigned i = (cpu >= 0) ? (unsigned)cpu : next_arena++;
+    return arena_at(i % arena_count);
+}
+
+/**
+ * @brief Thread exit hook: parks the thread's slab cache for reuse.
+ *
+ * The cache keeps its runs, and slots that are still live elsewhere keep
+ * arriving on its remote queue; the next thread to adopt it drains them.
+ *
+ * @param[in] cache The exiting thread's cache
+ */
+static void abandon_cache(void *cache) {
+    tcache_t *dead = cache;
+
+    pthread_mutex_lock(&setup_mutex);
+    dead->next = abandoned;
+    abandoned = dead;
+    pthread_mutex_unlock(&setup_mutex);
+    tcache = NULL;
+}
+
+/**
+ * @brief Creates cache_key, through pthread_once so that mm_init can run
+ * more than once.
+ */
+static void create_cache_key(void) {
+    cache_key_ready = pthread_key_create(&cache_key, abandon_cache) == 0;
+}
+#endif
+
+/*
+ * ---------------------------------------------------------------------------
+ *                        HEAP STATISTICS
+ * ---------------------------------------------------------------------------
+ */
+
+/**
+ * @brief Adds up the blocks of one arena's heap, counting slab runs as
+ * allocated blocks.
+ *
+ * @param[in] a The arena
+ * @param[out] stats Where to add the arena's bytes
+ */
+static void arena_stats(arena_t *a, mm_heapstats_t *stats) {
+    for (block_t *block = a->heap_start; get_size(block) != 0;
+         block = find_next(block)) {
+        if (get_alloc(block)) {
+            stats->alloc_bytes += get_size(block);
+        } else {
+            stats->free_bytes += get_size(block);
+        }
+    }
+}
+
+/**
+ * @brief Splits the runs of a slab cache into slots in use, free slots and
+ * bookkeeping.
+ *
+ * A run with free slots is always on its class's list, so walking the lists
+ * finds every free slot; the runs that are off the lists are full. What the
+ * runs hold besides their slots is tallied in run_meta as they come and go.
+ *
+ * @param[in] cache The slab cache
+ * @param[out] stats Where arena_stats counted the runs as allocated
+ */
+static void cache_stats(tcache_t *cache, mm_heapstats_t *stats) {
+    stats->alloc_bytes -= cache->run_meta;
+    for (int i = 0; i < slab_class_count; i++) {
+        for (block_t *run = cache->runs[i]; run != NULL;
+             run = (run->body).run.next) {
+            size_t free_bytes =
+                (size_t)(run->body).run.free_count * (run->body).run.slot_size;
+            stats->alloc_bytes -= free_bytes;
+            stats->free_bytes += free_bytes;
+        }
+    }
+}
+
+/**
+ * @brief Describes the heap for the drivers' fragmentation reports.
+ *
+ * With MM_THREADS, the runs of other threads' caches count as allocated.
+ *
+ * @param[out] stats Where to store the description
+ * @return true on success, false if the heap is not initialized
+ */
+bool mm_heapstats(mm_heapstats_t *stats) {
+    stats->alloc_bytes = 0;
+    stats->free_bytes = 0;
+    stats->header_size = wsize;
+    stats->alignment = dsize;
+
+#ifdef MM_THREADS
+    if (main_arena == NULL) {
+        return false;
+    }
+    for (unsigned i = 0; i < arena_count; i++) {
+        lock_arena(arena_at(i));
+        arena_stats(arena, stats);
+        unlock_arena();
+    }
+    // other threads' runs can't be walked safely, so they stay allocated
+    if (tcache != NULL) {
+        cache_stats(tcache, stats);
+    }
+#else
+    if (arena == NULL) {
+        return false;
+    }
+    arena_stats(arena, stats);
+    cache_stats(tcache, stats);
+#endif
+    return true;
+}
+
+/**
+ * @brief
+ *
+ * <What does this function do?>
+ * <What are the function's arguments?>
+ * <What is the function's return value?>
+ * <Are there any preconditions or postconditions?>
+ *
+ * @return
+ */
+bool mm_init(void) {
+    // Create the initial empty heap, with the arena (and the slab cache, when
+    // there is only one) in front of it. The table is padded to dsize so
+    // payloads stay 16-byte aligned.
+    size_t table_size = sizeof(arena_t);
+#ifndef MM_THREADS
+    table_size += sizeof(tcache_t);
+#endif
+    table_size = round_up(table_size, dsize);
+    lock_memlib();
+    char *table = mem_sbrk(table_size + 2 * wsize);
+    unlock_memlib();
+
+    if (table == (void *)-1) {
+        return false;
+    }
+
+#ifdef MM_THREADS
+    pthread_once(&cache_key_once, create_cache_key);
+    if (!cache_key_ready) {
+        return false;
+    }
+    // A re-init throws away every arena and cache, so the calling thread
+    // starts over with a fresh cache. This is only safe once the threads
+    // that used the old heap have exited.
+    tcache = NULL;
+    arena = NULL;
+    abandoned = NULL;
+    next_arena = 0;
+    pthread_setspecific(cache_key, NULL);
+
+    arena_t *first = (arena_t *)table;
+    first->brk = NULL;
+    first->limit = NULL;
+    pthread_mutex_init(&first->lock, NULL);
+    if (!init_arena(first, (word_t *)(table + table_size))) {
+        return false;
+    }
+    main_arena = first;
+    return add_arenas(table_size);
+#else
+    tcache = (tcache_t *)(table + sizeof(arena_t));
+    for (int i = 0; i < slab_class_count; i++) {
+        tcache->runs[i] = NULL;
+        tcache->run_count[i] = 0;
+    }
+    tcache->run_meta = 0;
+    tcache->home = (arena_t *)table;
+    return init_arena((arena_t *)table, (word_t *)(table + table_size));
+#endif
+}
+
+/**
+ * @brief Sets up the slab cache of the calling thread.
+ *
+ * Without MM_THREADS the cache lives in the heap table, so this only has to
+ * initialize the heap. With MM_THREADS the arenas are set up on the first
+ * call from any thread. Each thread then picks a home arena, and adopts a
+ * cache left behind by an exited thread or carves a fresh one from it.
+ *
+ * @return true on success, false if out of memory
+ */
+static bool attach_cache(void) {
+#ifdef MM_THREADS
+    tcache_t *cache = NULL;
+    arena_t *home = NULL;
+
+    pthread_mutex_lock(&setup_mutex);
+    if (main_arena != NULL || mm_init()) {
+        home = pick_arena();
+        if (abandoned != NULL) {
+            cache = abandoned;
+            abandoned = cache->next;
+        }
+    }
+    pthread_mutex_unlock(&setup_mutex);
+
+    if (home == NULL) {
         return false;
     }
 
+    if (cache == NULL) {
+        lock_arena(home);
+        block_t *block = alloc_block(round_up(sizeof(tcache_t) + wsize, dsize));
+        unlock_arena();
+        if (block == NULL) {
+            return false;
+        }
+        cache = (tcache_t *)header_to_payload(block);
+        for (int i = 0; i < slab_class_count; i++) {
+            cache->runs[i] = NULL;
+            cache->run_count[i] = 0;
+        }
+        cache->run_meta = 0;
+        cache->remote = NULL;
+    }
+
+    // an adopted cache keeps its runs, wherever they are, but carves new
+    // ones from this thread's arena
+    cache->home = home;
+    tcache = cache;
+    pthread_setspecific(cache_key, cache);
     return true;
+#else
+    return mm_init();
+#endif
 }
 
 /**
@@ -1146,14 +2312,13 @@ bool mm_init(void) {
 void *malloc(size_t size) {
     dbg_requires(mm_checkheap(__LINE__));
 
-    size_t asize;      // Adjusted block size
-    size_t extendsize; // Amount to extend heap if no fit is found
+    size_t asize; // Adjusted block size
     block_t *block;
     void *bp = NULL;
 
-    // Initialize heap if it isn't initialized
-    if (heap_start == NULL) {
-        mm_init();
+    // Initialize heap (and this thread's cache) if it isn't initialized
+    if (tcache == NULL && !attach_cache()) {
+        return NULL;
     }
 
     // Ignore spurious request
@@ -1162,57 +2327,35 @@ void *malloc(size_t size) {
         return bp;
     }
 
+    if (mmap_threshold != 0 && size >= mmap_threshold) {
+        return map_alloc(size);
+    }
+
     // Adjust block size to include overhead and to meet alignment requirements
     // we take in the request size and then we add the internal fragmentation
     // size to it (multiple of dsize) note: dsize is the size of the header +
     // footer, dont' aallocate this much lol wsize = size of one header
     asize = round_up(size + wsize, dsize);
 
-    // Search the free list for a fit
-    block = find_fit(asize);
-
-    // If no fit is found, request more memory, and then and place the block
-    if (block == NULL) {
-        // Always request at least chunksize
-        extendsize = max(asize, chunksize);
-        block = extend_heap(extendsize);
-        // extend_heap returns an error
-        if (block == NULL) {
-            return bp;
-        }
-    }
-
-    // The block should be marked as free
-    dbg_assert(!get_alloc(block));
-
-    // Mark block as allocated
-    size_t block_size = get_size(block);
-    remove_block(block);
-    // conceptually, the block before must always be allocated
-    write_block(block, block_size, true, true, get_before_mini(block));
-
-    // Try to split the block if too large
-    split_block(block, asize);
-
-    block_t *next = find_next(block);
-
-    bool is_mini_block = is_mini(block);
-    // updating the block after to change alloc status
-    if (get_size(next) > 0) {
-        if (get_alloc(next) == 0) {
-            remove_block(next);
+    if (asize <= slab_max_size) {
+        bp = slab_alloc(asize);
+    } else {
+        lock_arena(tcache->home);
+        block = alloc_block(asize);
+        unlock_arena();
+#ifdef MM_THREADS
+        // only arena 0 can grow past arena_span
+        if (block == NULL && tcache->home != main_arena) {
+            lock_arena(main_arena);
+            block = alloc_block(asize);
+            unlock_arena();
         }
-        write_block(next, get_size(next), get_alloc(next), true, is_mini_block);
-        if (get_alloc(next) == 0) {
-            add_block(next);
+#endif
+        if (block != NULL) {
+            bp = header_to_payload(block);
         }
-    } else {
-        dbg_assert(get_size(next) == 0);
-        write_epilogue(next, true, is_mini_block);
     }
 
-    bp = header_to_payload(block);
-
     dbg_ensures(mm_checkheap(__LINE__));
     return bp;
 }
@@ -1235,34 +2378,96 @@ void free(void *bp) {
     }
 
     block_t *block = payload_to_header(bp);
-    size_t size = get_size(block);
-    bool prev_alloc = get_before_alloc(block);
+    if (is_mapped(block)) {
+        map_free(block);
+    } else if (is_slab_slot(block)) {
+        slab_free(block);
+    } else {
+        lock_arena(arena_of(block));
+        free_block(block);
+        unlock_arena();
+    }
 
-    // The block should be marked as allocated
-    dbg_assert(get_alloc(block));
+    dbg_ensures(mm_checkheap(__LINE__));
+}
 
-    // Mark the block as free
-    write_block(block, size, false, prev_alloc, get_before_mini(block));
-    add_block(block);
+/**
+ * @brief Shrinks an allocated block to `asize` bytes in place.
+ *
+ * If the leftover tail is big enough to be a block of its own, it is split
+ * off and handed to free_block, which also coalesces it with a free
+ * successor and fixes up the successor's prev_alloc/prev_mini bits.
+ *
+ * @param[in] block An allocated block
+ * @param[in] asize The new block size, a multiple of dsize
+ * @pre `asize <= get_size(block)`
+ */
+static void shrink_block(block_t *block, size_t asize) {
+    dbg_requires(get_alloc(block));
+    dbg_requires(asize <= get_size(block));
 
-    // Try to coalesce the block with its neighbors
-    block = coalesce_block(block);
+    size_t block_size = get_size(block);
+    if (block_size - asize < min_block_size) {
+        return;
+    }
+
+    write_block(block, asize, true, get_before_alloc(block),
+                get_before_mini(block));
+    block_t *tail = find_next(block);
+    write_block(tail, block_size - asize, true, true, is_mini(block));
+    free_block(tail);
+}
+
+/**
+ * @brief Grows an allocated block to at least `asize` bytes in place.
+ *
+ * The block absorbs its successor if that is free. If the block (or its free
+ * successor) is the last one in the heap, the heap is extended by exactly the
+ * missing amount first. Any excess is split off again with shrink_block.
+ *
+ * @param[in] block An allocated block
+ * @param[in] asize The requested block size, a multiple of dsize
+ * @return true if the block now has at least `asize` bytes, false if it has
+ *         to move (the block is unchanged in that case)
+ * @pre `asize > get_size(block)`
+ */
+static bool grow_block(block_t *block, size_t asize) {
+    dbg_requires(get_alloc(block));
+    dbg_requires(asize > get_size(block));
 
+    size_t block_size = get_size(block);
     block_t *next = find_next(block);
-    if (get_size(next) > 0) {
-        if (get_alloc(next) == 0) {
-            remove_block(next);
+    // the epilogue counts as allocated, so this also stops at the heap end
+    bool next_free = !get_alloc(next);
+    size_t avail = block_size + (next_free ? get_size(next) : 0);
+
+    if (avail < asize) {
+        block_t *last = next_free ? find_next(next) : next;
+        if (get_size(last) != 0) {
+            return false;
         }
-        write_block(next, get_size(next), get_alloc(next), false,
-                    is_mini(block));
-        if (get_alloc(next) == 0) {
-            add_block(next);
+        // extend_heap coalesces the new space into a free successor
+        if (extend_heap(asize - avail) == NULL) {
+            return false;
         }
+        next = find_next(block);
+    }
+
+    dbg_assert(!get_alloc(next));
+    remove_block(next);
+    write_block(block, block_size + get_size(next), true,
+                get_before_alloc(block), get_before_mini(block));
+
+    // the successor of a free block is always allocated (or the epilogue)
+    block_t *after = find_next(block);
+    if (get_size(after) > 0) {
+        write_block(after, get_size(after), true, true, false);
     } else {
-        write_epilogue(next, false, is_mini(block));
+        write_epilogue(after, true, false);
     }
 
-    dbg_ensures(mm_checkheap(__LINE__));
+    shrink_block(block, asize);
+    return true;
 }
 
 /**
@@ -1293,6 +2498,43 @@ void *realloc(void *ptr, size_t size) {
         return malloc(size);
     }
 
+    // Resize in place when the block or its neighborhood allows it; only
+    // fall back to copying when the block really has to move. Blocks of
+    // mmap_threshold bytes or more belong in mappings, which move without
+    // copying.
+    size_t asize = round_up(size + wsize, dsize);
+    bool map = mmap_threshold != 0 && size >= mmap_threshold;
+    if (is_mapped(block)) {
+        if (map) {
+            return map_realloc(block, size);
+        }
+        copysize = get_map_length(block) - dsize;
+    } else if (map) {
+        copysize = is_slab_slot(block)
+                       ? (slot_to_run(block)->body).run.slot_size - wsize
+                       : get_payload_size(block);
+    } else if (is_slab_slot(block)) {
+        size_t slot_size = (slot_to_run(block)->body).run.slot_size;
+        if (asize <= slot_size) {
+            return ptr;
+        }
+        copysize = slot_size - wsize;
+    } else {
+        lock_arena(arena_of(block));
+        bool resized = true;
+        if (asize <= get_size(block)) {
+            shrink_block(block, asize);
+        } else if (!grow_block(block, asize)) {
+            resized = false;
+            copysize = get_payload_size(block); // gets size of old payload
+        }
+        unlock_arena();
+        if (resized) {
+            dbg_ensures(mm_checkheap(__LINE__));
+            return ptr;
+        }
+    }
+
     // Otherwise, proceed with reallocation
     newptr = malloc(size);
 
@@ -1302,7 +2544,6 @@ void *realloc(void *ptr, size_t size) {
     }
 
     // Copy the old data
-    copysize = get_payload_size(block); // gets size of old payload
     if (size < copysize) {
         copysize = size;
     }
@@ -1343,8 +2584,11 @@ void *calloc(size_t elements, size_t size) {
         return NULL;
     }
 
-    // Initialize all bits to 0
-    memset(bp, 0, asize);
+    // Initialize all bits to 0, unless the block has a fresh mapping, which
+    // reads as zeros already
+    if (!is_mapped(payload_to_header(bp))) {
+        memset(bp, 0, asize);
+    }
 
     return bp;
 }
@@ -65,6 +65,30 @@ extern void *calloc(size_t nmemb, size_t size);
  */
 extern bool mm_init(void);
 
+/**
+ * @brief  Where the bytes of the heap are, for the drivers' fragmentation
+ *         reports.
+ *
+ * Only the heap grown with mem_sbrk is described; mappings made with
+ * mem_map are counted by the caller. Bytes in neither field are the
+ * allocator's own metadata.
+ */
+typedef struct {
+    size_t alloc_bytes; /* in allocated blocks, their headers included */
+    size_t free_bytes;  /* in free blocks the allocator can hand out again */
+    size_t header_size; /* overhead of each allocated block */
+    size_t alignment;   /* block sizes are a multiple of this */
+} mm_heapstats_t;
+
+/**
+ * @brief  Describe the heap.
+ *
+ * @param[out] stats  Where to store the description.
+ *
+ * @return  True on success, False if the heap is not initialized.
+ */
+extern bool mm_heapstats(mm_heapstats_t *stats);
+
 /* This is for debugging.  Returns false if error encountered */
 /**
  * @brief  Check the heap for inconsistencies.
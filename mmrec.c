@@ -0,0 +1,581 @@
+/*
+ * mmrec.c - Record the allocator requests of any program as a trace
+ *
+ * Built as mmrec.so and preloaded into a program,
+ *
+ *     MMREC_OUT=app.rep LD_PRELOAD=./mmrec.so app ...
+ *
+ * it hands every malloc, calloc, realloc, free and aligned allocation on to
+ * the C library and logs it. Each thread appends its events to a ring of its
+ * own, without locks, and writes the ring out with a single write(2) to a
+ * scratch file when it fills. Every event carries a sequence number from one
+ * atomic counter, which is all the threads share: an allocation is numbered
+ * after it returns and a free before it is made, so a block is always seen
+ * to be allocated before it is freed, whichever threads do the two.
+ *
+ * When the program exits the scratch file is turned into a .rep trace that
+ * the drivers can replay. Each allocation gets the next block id, as in the
+ * other traces, and the header gets the number of ids, the number of
+ * requests and the peak number of live bytes. calloc and the
+ * aligned allocators are recorded as plain allocations; blocks freed without
+ * having been seen allocated (before recording started, say) are ignored.
+ *
+ * Environment:
+ *   MMREC_OUT     the trace to write; "%p" in it is replaced by the process
+ *                 id, which keeps programs that exec others from clobbering
+ *                 their own trace (default mmrec.%p.rep)
+ *   MMREC_WEIGHT  the weight of the trace (default 1)
+ *
+ * Children that fork without exec are not recorded.
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+/* The C library's allocator, which glibc exports under these names */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+#define RING_EVENTS 4096 /* events per thread between writes */
+#define MAXPATH 4096
+
+/* Event types, kept in the top bits of the sequence number */
+#define EV_SHIFT 62
+#define EV_ALLOC 1ULL
+#define EV_FREE 2ULL
+#define EV_REALLOC 3ULL
+#define EV_SEQ_MASK ((1ULL << EV_SHIFT) - 1)
+
+/* One recorded request */
+typedef struct
+{
+    uint64_t seq;  /* position in the global order, and the type */
+    uint64_t ptr;  /* block returned, or freed */
+    uint64_t old;  /* block passed to realloc */
+    uint64_t size; /* requested size */
+} event_t;
+
+/* The events of one thread not yet written out */
+typedef struct ring
+{
+    struct ring *next; /* next in the list of all rings */
+    unsigned count;    /* events in use */
+    event_t events[RING_EVENTS];
+} ring_t;
+
+/* Recorder states */
+enum
+{
+    UNSTARTED,
+    STARTING,
+    RECORDING,
+    STOPPED
+};
+
+static atomic_int state = UNSTARTED;
+static atomic_uint_fast64_t next_seq;
+static _Atomic(ring_t *) rings;
+static pthread_key_t ring_key;
+static int raw_fd = -1;
+static char raw_path[MAXPATH];
+static char out_path[MAXPATH];
+static int weight = 1;
+static pid_t recorder; /* the process being recorded */
+
+/* Initial-exec TLS: the general model may allocate on first access */
+static __thread ring_t *my_ring __attribute__((tls_model("initial-exec")));
+
+static void stop(void);
+
+/*
+ * flush_ring - write the events of a ring to the scratch file
+ */
+static void flush_ring(ring_t *ring)
+{
+    const char *p = (const char *)ring->events;
+    size_t left = ring->count * sizeof(event_t);
+
+    while (left > 0)
+    {
+        ssize_t n = write(raw_fd, p, left);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        p += n;
+        left -= (size_t)n;
+    }
+    ring->count = 0;
+}
+
+/*
+ * thread_exit - flush the ring of a thread that is exiting
+ *
+ * The ring itself stays on the list, since the thread may still free
+ * things from later destructors; its pages are given back meanwhile.
+ */
+static void thread_exit(void *arg)
+{
+    ring_t *ring = arg;
+
+    if (atomic_load(&state) != RECORDING)
+        return;
+    flush_ring(ring);
+    madvise(ring->events, sizeof(ring->events), MADV_DONTNEED);
+}
+
+/*
+ * expand_path - copy MMREC_OUT to out_path, replacing "%p" by the pid
+ */
+static bool expand_path(const char *pattern)
+{
+    size_t len = 0;
+
+    for (const char *p = pattern; *p != '\0'; p++)
+    {
+        int n;
+
+        if (p[0] == '%' && p[1] == 'p')
+        {
+            n = snprintf(out_path + len, MAXPATH - len, "%ld",
+                         (long)getpid());
+            p++;
+        }
+        else
+            n = snprintf(out_path + len, MAXPATH - len, "%c", *p);
+        if (n < 0 || (size_t)n >= MAXPATH - len)
+            return false;
+        len += (size_t)n;
+    }
+    return len > 0;
+}
+
+/*
+ * start - set the recorder up on the first request; returns whether
+ *         requests are being recorded
+ *
+ * Requests made while starting up (getenv, open and friends may allocate)
+ * are passed through without being recorded.
+ */
+static bool start(void)
+{
+    int expected = UNSTARTED;
+    const char *env;
+
+    if (!atomic_compare_exchange_strong(&state, &expected, STARTING))
+        return expected == RECORDING;
+
+    env = getenv("MMREC_OUT");
+    if (!expand_path(env != NULL ? env : "mmrec.%p.rep") ||
+        snprintf(raw_path, MAXPATH, "%s.events", out_path) >= MAXPATH)
+    {
+        fprintf(stderr, "mmrec: trace name too long\n");
+        atomic_store(&state, STOPPED);
+        return false;
+    }
+    if ((env = getenv("MMREC_WEIGHT")) != NULL)
+        weight = atoi(env);
+
+    raw_fd = open(raw_path, O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+                  0644);
+    if (raw_fd < 0 || pthread_key_create(&ring_key, thread_exit) != 0)
+    {
+        fprintf(stderr, "mmrec: could not create %s: %s\n", raw_path,
+                strerror(errno));
+        atomic_store(&state, STOPPED);
+        return false;
+    }
+
+    recorder = getpid();
+
+    /* A forked child shares the scratch file, so it must not write to it */
+    pthread_atfork(NULL, NULL, stop);
+    atexit(stop);
+    atomic_store(&state, RECORDING);
+    return true;
+}
+
+/*
+ * new_ring - give the calling thread a ring of its own
+ */
+static ring_t *new_ring(void)
+{
+    ring_t *ring = mmap(NULL, sizeof(ring_t), PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (ring == MAP_FAILED)
+        return NULL;
+    ring->next = atomic_load(&rings);
+    while (!atomic_compare_exchange_weak(&rings, &ring->next, ring))
+        ;
+    my_ring = ring;
+    pthread_setspecific(ring_key, ring);
+    return ring;
+}
+
+/*
+ * record - log one request of the calling thread
+ */
+static inline void record(uint64_t type, const void *ptr, const void *old,
+                          size_t size)
+{
+    ring_t *ring = my_ring;
+    event_t *ev;
+
+    if (atomic_load_explicit(&state, memory_order_relaxed) != RECORDING &&
+        !start())
+        return;
+    if (ring == NULL && (ring = new_ring()) == NULL)
+        return;
+
+    ev = &ring->events[ring->count];
+    ev->seq = atomic_fetch_add_explicit(&next_seq, 1, memory_order_relaxed) |
+              (type << EV_SHIFT);
+    ev->ptr = (uintptr_t)ptr;
+    ev->old = (uintptr_t)old;
+    ev->size = size;
+    if (++ring->count == RING_EVENTS)
+        flush_ring(ring);
+}
+
+/*
+ * The interposed allocator
+ */
+void *malloc(size_t size)
+{
+    void *p = __libc_malloc(size);
+
+    if (p != NULL)
+        record(EV_ALLOC, p, NULL, size);
+    return p;
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    void *p = __libc_calloc(nmemb, size);
+
+    if (p != NULL)
+        record(EV_ALLOC, p, NULL, nmemb * size);
+    return p;
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    void *p;
+
+    if (ptr == NULL)
+        return malloc(size);
+    if (size == 0)
+    {
+        record(EV_FREE, ptr, NULL, 0);
+        return __libc_realloc(ptr, 0);
+    }
+    if ((p = __libc_realloc(ptr, size)) != NULL)
+        record(EV_REALLOC, p, ptr, size);
+    return p;
+}
+
+void free(void *ptr)
+{
+    if (ptr != NULL)
+        record(EV_FREE, ptr, NULL, 0);
+    __libc_free(ptr);
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+    void *p = __libc_memalign(alignment, size);
+
+    if (p != NULL)
+        record(EV_ALLOC, p, NULL, size);
+    return p;
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    return memalign(alignment, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    void *p;
+
+    if (alignment % sizeof(void *) != 0 ||
+        (alignment & (alignment - 1)) != 0)
+        return EINVAL;
+    if ((p = memalign(alignment, size)) == NULL)
+        return ENOMEM;
+    *memptr = p;
+    return 0;
+}
+
+void *valloc(size_t size)
+{
+    return memalign((size_t)sysconf(_SC_PAGESIZE), size);
+}
+
+/*
+ * Conversion of the events into a trace
+ */
+
+/* A live block, in an open-addressed table keyed by address */
+typedef struct
+{
+    uint64_t ptr; /* address; 0 for an empty slot */
+    int32_t id;   /* block id in the trace */
+    uint64_t size;
+} block_t;
+
+typedef struct
+{
+    block_t *slots;
+    size_t mask;  /* number of slots - 1 */
+    size_t count; /* slots in use */
+} table_t;
+
+static size_t slot_of(const table_t *t, uint64_t ptr)
+{
+    return (size_t)((ptr >> 4) * 0x9e3779b97f4a7c15ULL) & t->mask;
+}
+
+static block_t *table_find(table_t *t, uint64_t ptr)
+{
+    for (size_t i = slot_of(t, ptr);; i = (i + 1) & t->mask)
+    {
+        if (t->slots[i].ptr == ptr)
+            return &t->slots[i];
+        if (t->slots[i].ptr == 0)
+            return NULL;
+    }
+}
+
+static bool table_insert(table_t *t, uint64_t ptr, int32_t id, uint64_t size)
+{
+    size_t i;
+
+    /* Keep the table at most half full */
+    if (2 * (t->count + 1) > t->mask + 1)
+    {
+        table_t bigger = {NULL, 2 * t->mask + 1, 0};
+
+        if ((bigger.slots = calloc(bigger.mask + 1, sizeof(block_t))) == NULL)
+            return false;
+        for (size_t j = 0; j <= t->mask; j++)
+        {
+            if (t->slots[j].ptr != 0)
+                table_insert(&bigger, t->slots[j].ptr, t->slots[j].id,
+                             t->slots[j].size);
+        }
+        free(t->slots);
+        *t = bigger;
+    }
+
+    for (i = slot_of(t, ptr); t->slots[i].ptr != 0; i = (i + 1) & t->mask)
+        ;
+    t->slots[i] = (block_t){ptr, id, size};
+    t->count++;
+    return true;
+}
+
+/* Remove a block, moving later entries of its run back into the hole */
+static void table_remove(table_t *t, block_t *b)
+{
+    size_t hole = (size_t)(b - t->slots);
+
+    for (size_t i = (hole + 1) & t->mask; t->slots[i].ptr != 0;
+         i = (i + 1) & t->mask)
+    {
+        size_t home = slot_of(t, t->slots[i].ptr);
+
+        /* Can the entry at i move back to the hole? */
+        if (((i - home) & t->mask) >= ((i - hole) & t->mask))
+        {
+            t->slots[hole] = t->slots[i];
+            hole = i;
+        }
+    }
+    t->slots[hole].ptr = 0;
+    t->count--;
+}
+
+/* The trace being built */
+typedef struct
+{
+    traceop_t *ops;
+    int num_ops;
+    int num_ids;
+    uint64_t live;
+    uint64_t peak;
+} builder_t;
+
+static void emit(builder_t *b, optype_t type, int32_t id, uint64_t size)
+{
+    b->ops[b->num_ops++] = (traceop_t){type, id, size};
+}
+
+static void release(builder_t *b, table_t *t, block_t *blk)
+{
+    emit(b, FREE, blk->id, 0);
+    b->live -= blk->size;
+    table_remove(t, blk);
+}
+
+static bool track_alloc(builder_t *b, table_t *t, uint64_t ptr, uint64_t size)
+{
+    int32_t id = b->num_ids++;
+
+    if (!table_insert(t, ptr, id, size))
+        return false;
+    emit(b, ALLOC, id, size);
+    b->live += size;
+    return true;
+}
+
+/*
+ * convert - turn the scratch file into the trace
+ *
+ * The events are in the file in the order the rings were written out, so
+ * they are first put back into sequence order. An allocation can still
+ * appear to return a block that is live, if a realloc that released it
+ * was numbered after the allocation in another thread; the old block is
+ * then taken to have been freed just before.
+ */
+static bool convert(void)
+{
+    struct stat st;
+    const event_t *events, **order;
+    uint64_t nseq = atomic_load(&next_seq);
+    size_t nevents;
+    table_t table = {NULL, 1023, 0};
+    builder_t b = {0};
+    tracefile_t trace;
+
+    if (fstat(raw_fd, &st) < 0)
+        return false;
+    nevents = (size_t)st.st_size / sizeof(event_t);
+    if (nevents > INT32_MAX / 2)
+    {
+        fprintf(stderr, "mmrec: too many requests for a trace\n");
+        return false;
+    }
+    events = nevents == 0 ? NULL
+                          : mmap(NULL, (size_t)st.st_size, PROT_READ,
+                                 MAP_PRIVATE, raw_fd, 0);
+    if (events == MAP_FAILED)
+        return false;
+
+    order = calloc(nseq + 1, sizeof(*order));
+    table.slots = calloc(table.mask + 1, sizeof(block_t));
+    b.ops = malloc((2 * nevents + 1) * sizeof(traceop_t));
+    if (order == NULL || table.slots == NULL || b.ops == NULL)
+        return false;
+
+    for (size_t i = 0; i < nevents; i++)
+    {
+        uint64_t seq = events[i].seq & EV_SEQ_MASK;
+
+        if (seq < nseq)
+            order[seq] = &events[i];
+    }
+
+    for (uint64_t s = 0; s < nseq; s++)
+    {
+        const event_t *ev = order[s];
+        block_t *blk;
+
+        if (ev == NULL) /* lost to a thread still running at exit */
+            continue;
+
+        switch (ev->seq >> EV_SHIFT)
+        {
+        case EV_ALLOC:
+            if ((blk = table_find(&table, ev->ptr)) != NULL)
+                release(&b, &table, blk);
+            if (!track_alloc(&b, &table, ev->ptr, ev->size))
+                return false;
+            break;
+
+        case EV_FREE:
+            if ((blk = table_find(&table, ev->ptr)) != NULL)
+                release(&b, &table, blk);
+            break;
+
+        case EV_REALLOC:
+            if ((blk = table_find(&table, ev->old)) == NULL)
+            {
+                if ((blk = table_find(&table, ev->ptr)) != NULL)
+                    release(&b, &table, blk);
+                if (!track_alloc(&b, &table, ev->ptr, ev->size))
+                    return false;
+                break;
+            }
+            int32_t id = blk->id;
+
+            b.live = b.live - blk->size + ev->size;
+            table_remove(&table, blk);
+            if ((blk = table_find(&table, ev->ptr)) != NULL)
+                release(&b, &table, blk);
+            if (!table_insert(&table, ev->ptr, id, ev->size))
+                return false;
+            emit(&b, REALLOC, id, ev->size);
+            break;
+        }
+        if (b.live > b.peak)
+            b.peak = b.live;
+    }
+
+    trace.weight = weight;
+    trace.num_ids = b.num_ids;
+    trace.num_ops = b.num_ops;
+    trace.data_bytes = (size_t)b.peak;
+    trace.ops = b.ops;
+    trace_write(out_path, &trace, false);
+
+    if (events != NULL)
+        munmap((void *)events, (size_t)st.st_size);
+    free(order);
+    free(table.slots);
+    free(b.ops);
+    return true;
+}
+
+/*
+ * stop - stop recording; in the process that started it, also write out
+ *        the rings and convert the events into the trace
+ */
+static void stop(void)
+{
+    int expected = RECORDING;
+
+    if (!atomic_compare_exchange_strong(&state, &expected, STOPPED))
+        return;
+    if (getpid() != recorder) /* a forked child */
+        return;
+
+    for (ring_t *ring = atomic_load(&rings); ring != NULL; ring = ring->next)
+        flush_ring(ring);
+
+    if (!convert())
+        fprintf(stderr, "mmrec: could not convert %s: %s\n", raw_path,
+                strerror(errno));
+    else
+        unlink(raw_path);
+    close(raw_fd);
+}
@@ -0,0 +1,518 @@
+/*
+ * mtbench.c - Multithreaded scaling benchmark for the malloc lab allocator
+ *
+ * Every thread replays a trace file on its own, with its own table of
+ * blocks, against the thread-safe build of mm.c (MM_THREADS), where each
+ * thread carves its blocks out of one of several arenas. Given several
+ * trace files, thread i replays file i mod n, so the threads run a mix of
+ * workloads. The traces are run with 1, 2, 4, ... up to the requested
+ * number of threads, and the aggregate throughput is reported together
+ * with the speedup over a single thread, the slowest and fastest thread,
+ * and the peak RSS (resident set size) of the whole process. The RSS is
+ * sampled every millisecond, and it includes whatever the allocator and
+ * earlier rows left resident, so it is not the heap of one row alone.
+ *
+ * With -r, the blocks a thread frees are handed to the next thread, which
+ * frees them on its behalf, so every free is a remote one. A single
+ * thread has no other thread to hand to, so it frees locally. The hand-offs
+ * go through a mutex-protected mailbox per thread, in batches, so that the
+ * mailboxes cost little next to the frees themselves.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "memlib.h"
+#include "mm.h"
+#include "trace.h"
+
+/**********************
+ * Constants and macros
+ **********************/
+
+#define DEFAULT_TRACE "syn-struct.rep"
+#define DEFAULT_REPS 8
+#define HANDOFF_BATCH 64     /* frees handed over at once with -r */
+#define MAILBOX_SLOTS 8192   /* blocks a mailbox holds before frees go local */
+#define SAMPLE_NSECS 1000000 /* how often the process RSS is sampled */
+
+/******************************
+ * The key compound data types
+ *****************************/
+
+/* The allocator being measured */
+typedef struct
+{
+    const char *name;
+    void *(*malloc)(size_t size);
+    void (*free)(void *ptr);
+    void *(*realloc)(void *ptr, size_t size);
+} allocator_t;
+
+/* Blocks handed to a thread for it to free (-r) */
+typedef struct
+{
+    pthread_mutex_t lock;
+    int count;                  /* number of blocks waiting */
+    char *slots[MAILBOX_SLOTS]; /* the blocks */
+} mailbox_t;
+
+/* Per-thread arguments and results */
+typedef struct
+{
+    pthread_t tid;
+    const tracefile_t *trace; /* the trace this thread replays */
+    int ok;                   /* set when the thread completed every replay */
+    double secs;              /* time the thread took for all its replays */
+    long remote;              /* frees this thread handed to another one */
+    mailbox_t *inbox;         /* blocks other threads want freed (-r) */
+    mailbox_t *outbox;        /* where frees go (-r), or NULL */
+} worker_t;
+
+/********************
+ * Global variables
+ *******************/
+
+static tracefile_t **traces;          /* the traces the threads replay */
+static int num_traces;                /* ... and how many there are */
+static const allocator_t *allocator;  /* the allocator under test */
+static int reps = DEFAULT_REPS;       /* replays per thread */
+static bool remote_frees = false;     /* hand every free to another thread */
+static bool per_thread = false;       /* print each thread's throughput */
+static pthread_barrier_t start_line;  /* lines the threads up for timing */
+static int running;                   /* threads still replaying */
+
+static const allocator_t mm_allocator = {"mm", mm_malloc, mm_free,
+                                         mm_realloc};
+static const allocator_t libc_allocator = {"libc", malloc, free, realloc};
+
+/*********************
+ * Function prototypes
+ *********************/
+
+static void *replay(void *arg);
+static double run_threads(int nthreads, double *min_kops, double *max_kops,
+                          size_t *peak);
+static void post_frees(worker_t *worker, char **batch, int n);
+static void take_frees(worker_t *worker, char **drain);
+static size_t resident_bytes(void);
+static double elapsed(const struct timespec *start,
+                      const struct timespec *end);
+static void usage(char *prog);
+static void unix_error(const char *fmt, ...)
+    __attribute__((format(printf, 1, 2), noreturn));
+static void app_error(const char *fmt, ...)
+    __attribute__((format(printf, 1, 2), noreturn));
+
+/**************
+ * Main routine
+ **************/
+int main(int argc, char **argv)
+{
+    long maxthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    const char **tracefiles = NULL;
+    int c;
+
+    allocator = &mm_allocator;
+
+    while ((c = getopt(argc, argv, "a:f:n:t:lrvh")) != EOF)
+    {
+        switch (c)
+        {
+        case 'a': /* Number of arenas, read by mm_init */
+            setenv("MM_ARENAS", optarg, 1);
+            break;
+        case 'f': /* Replay this trace file; may be given several times */
+            tracefiles = realloc(tracefiles, (num_traces + 1) * sizeof(char *));
+            if (tracefiles == NULL)
+                unix_error("realloc failed in main");
+            tracefiles[num_traces++] = optarg;
+            break;
+        case 'n': /* Replays per thread */
+            reps = atoi(optarg);
+            break;
+        case 't': /* Largest thread count */
+            maxthreads = atol(optarg);
+            break;
+        case 'l': /* Measure libc malloc instead */
+            allocator = &libc_allocator;
+            break;
+        case 'r': /* Free every block on another thread */
+            remote_frees = true;
+            break;
+        case 'v': /* Print each thread's throughput */
+            per_thread = true;
+            break;
+        case 'h': /* Print this message */
+            usage(argv[0]);
+            exit(0);
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+    if (maxthreads < 1 || reps < 1)
+    {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    if (num_traces == 0)
+    {
+        static const char *default_trace = TRACEDIR DEFAULT_TRACE;
+        tracefiles = &default_trace;
+        num_traces = 1;
+    }
+    if ((traces = calloc(num_traces, sizeof(tracefile_t *))) == NULL)
+        unix_error("calloc failed in main");
+    for (int i = 0; i < num_traces; i++)
+        traces[i] = trace_load(tracefiles[i], true);
+
+    if (allocator == &mm_allocator)
+    {
+        mem_init(false);
+        if (!mm_init())
+            app_error("mm_init failed");
+    }
+
+    for (int i = 0; i < num_traces; i++)
+        printf("%s: %d ops\n", tracefiles[i], traces[i]->num_ops);
+    printf("%d replays per thread, %s allocator, %s frees\n", reps,
+           allocator->name, remote_frees ? "remote" : "local");
+    printf("%8s %14s %10s %12s %12s %10s\n", "threads", "Kops/sec", "speedup",
+           "min Kops/thr", "max Kops/thr", "peakRSSKB");
+
+    double base = 0;
+    long n = 1;
+    while (true)
+    {
+        double min_kops, max_kops;
+        size_t peak;
+        double kops = run_threads((int)n, &min_kops, &max_kops, &peak);
+        if (n == 1)
+            base = kops;
+        printf("%8ld %14.0f %10.2f %12.0f %12.0f %10zu\n", n, kops,
+               kops / base, min_kops, max_kops, peak / 1024);
+        if (n == maxthreads)
+            break;
+        /* Double up, but always finish with the largest thread count */
+        n = (n * 2 < maxthreads) ? n * 2 : maxthreads;
+    }
+
+    for (int i = 0; i < num_traces; i++)
+        trace_close(traces[i]);
+    free(traces);
+    return 0;
+}
+
+/*
+ * run_threads - replay the traces on nthreads threads at once, and return
+ *               the aggregate throughput in Kops/sec; also report the
+ *               slowest and fastest thread and the peak RSS of the
+ *               process; with -r, frees are handed over only when there
+ *               is more than one thread
+ */
+static double run_threads(int nthreads, double *min_kops, double *max_kops,
+                          size_t *peak)
+{
+    worker_t *workers = calloc(nthreads, sizeof(worker_t));
+    mailbox_t *boxes = NULL;
+    bool handoff = remote_frees && nthreads > 1;
+    struct timespec start, end;
+    double ops = 0;
+
+    if (workers == NULL)
+        unix_error("calloc failed in run_threads");
+    if (handoff && (boxes = calloc(nthreads, sizeof(mailbox_t))) == NULL)
+        unix_error("calloc failed in run_threads");
+    if (pthread_barrier_init(&start_line, NULL, nthreads + 1) != 0)
+        app_error("pthread_barrier_init failed");
+
+    __atomic_store_n(&running, nthreads, __ATOMIC_RELAXED);
+    for (int i = 0; i < nthreads; i++)
+    {
+        worker_t *worker = &workers[i];
+
+        worker->trace = traces[i % num_traces];
+        if (handoff)
+        {
+            pthread_mutex_init(&boxes[i].lock, NULL);
+            worker->inbox = &boxes[i];
+            worker->outbox = &boxes[(i + 1) % nthreads];
+        }
+        if (pthread_create(&worker->tid, NULL, replay, worker) != 0)
+            app_error("pthread_create failed");
+    }
+
+    pthread_barrier_wait(&start_line);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    /* Watch the memory footprint while the threads run */
+    *peak = resident_bytes();
+    while (__atomic_load_n(&running, __ATOMIC_ACQUIRE) > 0)
+    {
+        struct timespec nap = {0, SAMPLE_NSECS};
+        size_t resident = resident_bytes();
+
+        if (resident > *peak)
+            *peak = resident;
+        nanosleep(&nap, NULL);
+    }
+
+    for (int i = 0; i < nthreads; i++)
+    {
+        pthread_join(workers[i].tid, NULL);
+        if (!workers[i].ok)
+            app_error("%s allocator ran out of memory", allocator->name);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    *min_kops = *max_kops = 0;
+    for (int i = 0; i < nthreads; i++)
+    {
+        double thread_ops = (double)workers[i].trace->num_ops * reps;
+        double kops = thread_ops / workers[i].secs / 1e3;
+
+        ops += thread_ops;
+        if (i == 0 || kops < *min_kops)
+            *min_kops = kops;
+        if (i == 0 || kops > *max_kops)
+            *max_kops = kops;
+        if (per_thread)
+            printf("%8s thread %d: %.0f Kops/sec, %ld remote frees\n", "",
+                   i, kops, workers[i].remote);
+    }
+
+    /* Free whatever was handed over after its new owner last looked */
+    for (int i = 0; handoff && i < nthreads; i++)
+    {
+        for (int j = 0; j < boxes[i].count; j++)
+            allocator->free(boxes[i].slots[j]);
+        pthread_mutex_destroy(&boxes[i].lock);
+    }
+
+    pthread_barrier_destroy(&start_line);
+    free(boxes);
+    free(workers);
+
+    return ops / elapsed(&start, &end) / 1e3;
+}
+
+/*
+ * replay - thread body: replay the trace reps times with a private block
+ *          table, freeing whatever is left over after each replay
+ */
+static void *replay(void *arg)
+{
+    worker_t *worker = arg;
+    const tracefile_t *trace = worker->trace;
+    bool handoff = worker->outbox != NULL;
+    char **blocks = calloc(trace->num_ids, sizeof(char *));
+    char **drain = handoff ? malloc(sizeof(char *) * MAILBOX_SLOTS) : NULL;
+    char *batch[HANDOFF_BATCH];
+    int batched = 0;
+    struct timespec start, end;
+
+    if (blocks == NULL || (handoff && drain == NULL))
+        unix_error("calloc failed in replay");
+
+    pthread_barrier_wait(&start_line);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int r = 0; r < reps; r++)
+    {
+        for (int i = 0; i < trace->num_ops; i++)
+        {
+            traceop_t *op = &trace->ops[i];
+            char *p;
+
+            switch (op->type)
+            {
+            case ALLOC:
+                if ((p = allocator->malloc(op->size)) == NULL)
+                    goto out;
+                blocks[op->index] = p;
+                break;
+            case REALLOC:
+                if ((p = allocator->realloc(blocks[op->index], op->size)) ==
+                    NULL)
+                    goto out;
+                blocks[op->index] = p;
+                break;
+            case FREE:
+                if (op->index < 0) /* free(NULL) */
+                {
+                    allocator->free(NULL);
+                    break;
+                }
+                if (!handoff)
+                    allocator->free(blocks[op->index]);
+                else if (blocks[op->index] != NULL)
+                {
+                    batch[batched++] = blocks[op->index];
+                    if (batched == HANDOFF_BATCH)
+                    {
+                        post_frees(worker, batch, batched);
+                        batched = 0;
+                        take_frees(worker, drain);
+                    }
+                }
+                blocks[op->index] = NULL;
+                break;
+            }
+        }
+
+        if (handoff)
+        {
+            post_frees(worker, batch, batched);
+            batched = 0;
+            take_frees(worker, drain);
+        }
+        for (int i = 0; i < trace->num_ids; i++)
+        {
+            allocator->free(blocks[i]);
+            blocks[i] = NULL;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    worker->secs = elapsed(&start, &end);
+    worker->ok = 1;
+
+out:
+    __atomic_fetch_sub(&running, 1, __ATOMIC_RELEASE);
+    free(drain);
+    free(blocks);
+    return NULL;
+}
+
+/*
+ * post_frees - hand n blocks to the next thread to free; if its mailbox is
+ *              full, free the rest here instead
+ */
+static void post_frees(worker_t *worker, char **batch, int n)
+{
+    mailbox_t *box = worker->outbox;
+    int posted;
+
+    pthread_mutex_lock(&box->lock);
+    posted = MAILBOX_SLOTS - box->count;
+    if (posted > n)
+        posted = n;
+    memcpy(&box->slots[box->count], batch, posted * sizeof(char *));
+    __atomic_store_n(&box->count, box->count + posted, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&box->lock);
+
+    worker->remote += posted;
+    for (int i = posted; i < n; i++)
+        allocator->free(batch[i]);
+}
+
+/*
+ * take_frees - free the blocks other threads have handed to this one,
+ *              using drain (MAILBOX_SLOTS long) to get them out of the
+ *              mailbox without holding its lock while freeing
+ */
+static void take_frees(worker_t *worker, char **drain)
+{
+    mailbox_t *box = worker->inbox;
+    int n;
+
+    /* A peek without the lock; a stale zero just means we look later */
+    if (__atomic_load_n(&box->count, __ATOMIC_RELAXED) == 0)
+        return;
+
+    pthread_mutex_lock(&box->lock);
+    n = box->count;
+    memcpy(drain, box->slots, n * sizeof(char *));
+    __atomic_store_n(&box->count, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&box->lock);
+
+    for (int i = 0; i < n; i++)
+        allocator->free(drain[i]);
+}
+
+/*
+ * resident_bytes - the resident set size of the whole process
+ */
+static size_t resident_bytes(void)
+{
+    FILE *statm = fopen("/proc/self/statm", "r");
+    unsigned long size, resident = 0;
+
+    if (statm == NULL)
+        return 0;
+    if (fscanf(statm, "%lu %lu", &size, &resident) != 2)
+        resident = 0;
+    fclose(statm);
+    return resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+/*
+ * elapsed - seconds from start to end
+ */
+static double elapsed(const struct timespec *start,
+                      const struct timespec *end)
+{
+    return (double)(end->tv_sec - start->tv_sec) +
+           (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/*
+ * usage - Explain the command line arguments
+ */
+static void usage(char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-hlrv] [-f <file>]... [-t <n>] [-n <n>] [-a <n>]\n",
+            prog);
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-f <file>  Replay <file> (default %s%s); given "
+                    "several times,\n"
+                    "\t           thread i replays the i-th file, "
+                    "round-robin.\n",
+            TRACEDIR, DEFAULT_TRACE);
+    fprintf(stderr, "\t-t <n>     Scale up to <n> threads (default: online "
+                    "CPUs).\n");
+    fprintf(stderr, "\t-n <n>     Replays per thread (default %d).\n",
+            DEFAULT_REPS);
+    fprintf(stderr, "\t-a <n>     Use <n> arenas (default: online CPUs).\n");
+    fprintf(stderr, "\t-l         Measure libc malloc instead of mm.c.\n");
+    fprintf(stderr, "\t-r         Free every block on the next thread "
+                    "over (a single\n"
+                    "\t           thread frees its own).\n");
+    fprintf(stderr, "\t-v         Print the throughput of each thread.\n");
+    fprintf(stderr, "\t-h         Print this message.\n");
+}
+
+/*
+ * unix_error - Report a Unix-style error and exit
+ */
+static void unix_error(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fprintf(stderr, ": %s\n", strerror(errno));
+    exit(1);
+}
+
+/*
+ * app_error - Report an application error and exit
+ */
+static void app_error(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fprintf(stderr, "\n");
+    exit(1);
+}
@@ -0,0 +1,144 @@
+/*
+ * perfctr.c - Hardware performance counters for the calling thread
+ *
+ * See perfctr.h. Each group has a leader, the first of its events that
+ * could be opened; the groups are started and stopped through their
+ * leaders, and every member is read on its own.
+ */
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "perfctr.h"
+
+#define NGROUPS 3
+
+/* A hardware cache event, as encoded for PERF_TYPE_HW_CACHE */
+#define CACHE_MISS(cache)                                                      \
+    ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) |                            \
+     (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+typedef struct
+{
+    uint32_t type;   /* perf_event_attr.type */
+    uint64_t config; /* perf_event_attr.config */
+    int group;       /* which group the event is counted in */
+} event_spec_t;
+
+static const event_spec_t events[PERFCTR_COUNT] = {
+    [PC_INSTRUCTIONS] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, 0},
+    [PC_CYCLES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, 0},
+    [PC_BRANCH_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, 0},
+    [PC_L1D_MISSES] = {PERF_TYPE_HW_CACHE,
+                       CACHE_MISS(PERF_COUNT_HW_CACHE_L1D), 1},
+    [PC_LLC_MISSES] = {PERF_TYPE_HW_CACHE, CACHE_MISS(PERF_COUNT_HW_CACHE_LL),
+                       1},
+    [PC_DTLB_MISSES] = {PERF_TYPE_HW_CACHE,
+                        CACHE_MISS(PERF_COUNT_HW_CACHE_DTLB), 1},
+    [PC_PAGE_FAULTS] = {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, 2},
+};
+
+const char *const perfctr_names[PERFCTR_COUNT] = {
+    [PC_INSTRUCTIONS] = "instrs",   [PC_CYCLES] = "cycles",
+    [PC_BRANCH_MISSES] = "br-miss", [PC_L1D_MISSES] = "L1D-miss",
+    [PC_LLC_MISSES] = "LLC-miss",   [PC_DTLB_MISSES] = "dTLB-miss",
+    [PC_PAGE_FAULTS] = "faults",
+};
+
+static int fds[PERFCTR_COUNT] = {-1, -1, -1, -1, -1, -1, -1};
+static int leaders[NGROUPS] = {-1, -1, -1};
+
+/*
+ * open_event - open one counter on the calling thread, in the group led by
+ *              leader (or as a new, disabled leader if that is -1)
+ */
+static int open_event(const event_spec_t *spec, int leader)
+{
+    struct perf_event_attr attr;
+    int fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = spec->type;
+    attr.config = spec->config;
+    attr.disabled = leader < 0;
+    attr.exclude_hv = 1;
+    attr.read_format =
+        PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    /* Include the kernel's work on our behalf if we are allowed to */
+    fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+    if (fd < 0 && (errno == EACCES || errno == EPERM))
+    {
+        attr.exclude_kernel = 1;
+        fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+    }
+    return fd;
+}
+
+int perfctr_open(void)
+{
+    int opened = 0;
+
+    for (int i = 0; i < PERFCTR_COUNT; i++)
+    {
+        int *leader = &leaders[events[i].group];
+
+        fds[i] = open_event(&events[i], *leader);
+        if (fds[i] < 0)
+            continue;
+        if (*leader < 0)
+            *leader = fds[i];
+        opened++;
+    }
+    return opened;
+}
+
+void perfctr_start(void)
+{
+    for (int g = 0; g < NGROUPS; g++)
+    {
+        if (leaders[g] < 0)
+            continue;
+        ioctl(leaders[g], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(leaders[g], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+}
+
+void perfctr_stop(perfctr_sample_t *sample)
+{
+    for (int g = 0; g < NGROUPS; g++)
+    {
+        if (leaders[g] >= 0)
+            ioctl(leaders[g], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    }
+
+    for (int i = 0; i < PERFCTR_COUNT; i++)
+    {
+        uint64_t value[3]; /* count, time enabled, time running */
+
+        sample->count[i] = -1.0;
+        if (fds[i] < 0 || read(fds[i], value, sizeof(value)) != sizeof(value))
+            continue;
+        if (value[2] == 0) /* the group never got onto the PMU */
+            continue;
+        sample->count[i] = (double)value[0] * (double)value[1] /
+                           (double)value[2];
+    }
+}
+
+void perfctr_close(void)
+{
+    for (int i = 0; i < PERFCTR_COUNT; i++)
+    {
+        if (fds[i] >= 0)
+            close(fds[i]);
+        fds[i] = -1;
+    }
+    for (int g = 0; g < NGROUPS; g++)
+        leaders[g] = -1;
+}
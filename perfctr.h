@@ -0,0 +1,56 @@
+/*
+ * perfctr.h - Hardware performance counters for the calling thread
+ *
+ * A thin layer over perf_event_open(2). The counters are opened as a few
+ * small groups, each of which the PMU can schedule on its own, so that
+ * counts within a group are taken over exactly the same instructions.
+ * Counters the kernel or the hardware cannot provide (no PMU in a virtual
+ * machine, a restrictive perf_event_paranoid, an event the CPU lacks) are
+ * simply left out, and read back as unavailable.
+ */
+#ifndef PERFCTR_H
+#define PERFCTR_H
+
+#include <stdbool.h>
+
+/* The events that are counted */
+typedef enum
+{
+    PC_INSTRUCTIONS,
+    PC_CYCLES,
+    PC_BRANCH_MISSES,
+    PC_L1D_MISSES,
+    PC_LLC_MISSES,
+    PC_DTLB_MISSES,
+    PC_PAGE_FAULTS,
+    PERFCTR_COUNT
+} perfctr_event_t;
+
+/* Short names of the events, for column headers */
+extern const char *const perfctr_names[PERFCTR_COUNT];
+
+/* Counts over one measured interval; negative where unavailable */
+typedef struct
+{
+    double count[PERFCTR_COUNT];
+} perfctr_sample_t;
+
+/*
+ * Open the counters for the calling thread, initially stopped.  Returns
+ * the number of events that could be opened; 0 means none at all.
+ */
+int perfctr_open(void);
+
+/* Zero and start the open counters */
+void perfctr_start(void);
+
+/*
+ * Stop the counters and store what they counted since perfctr_start.
+ * Counts are scaled up if the kernel had to multiplex the groups.
+ */
+void perfctr_stop(perfctr_sample_t *sample);
+
+/* Close the counters */
+void perfctr_close(void);
+
+#endif /* PERFCTR_H */
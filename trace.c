@@ -0,0 +1,311 @@
+/*
+ * trace.c - Reading and writing malloc lab trace files
+ *
+ * See trace.h for a description of the two trace formats.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define MAXLINE 1024 /* max string size */
+
+_Static_assert(sizeof(traceop_t) == 16, "traceop_t is the on-disk record");
+_Static_assert(sizeof(trace_header_t) % sizeof(traceop_t) == 0,
+               "requests must stay aligned after the header");
+
+static tracefile_t *load_text(const char *filename);
+static tracefile_t *load_binary(const char *filename, int fd, size_t len);
+static void check_ops(const char *filename, const tracefile_t *trace);
+static void trace_error(const char *filename, const char *msg)
+    __attribute__((noreturn));
+
+/*
+ * binary_sibling - if filename is X.rep and X.repb exists and is at least as
+ *                  new, store the name of X.repb in buf and return true
+ */
+static bool binary_sibling(const char *filename, char *buf, size_t buflen)
+{
+    size_t len = strlen(filename);
+    struct stat text, binary;
+
+    if (len < 4 || strcmp(filename + len - 4, ".rep") != 0)
+        return false;
+    if (len + 2 > buflen)
+        return false;
+    strcpy(buf, filename);
+    strcpy(buf + len - 4, BINARY_TRACE_EXT);
+
+    if (stat(buf, &binary) != 0 || stat(filename, &text) != 0)
+        return false;
+    if (binary.st_mtim.tv_sec != text.st_mtim.tv_sec)
+        return binary.st_mtim.tv_sec > text.st_mtim.tv_sec;
+    return binary.st_mtim.tv_nsec >= text.st_mtim.tv_nsec;
+}
+
+/*
+ * trace_load - load a trace of either format
+ */
+tracefile_t *trace_load(const char *filename, bool prefer_binary)
+{
+    char binname[MAXLINE];
+    trace_header_t header;
+    struct stat st;
+    int fd;
+
+    if (prefer_binary && binary_sibling(filename, binname, sizeof(binname)))
+        filename = binname;
+
+    if ((fd = open(filename, O_RDONLY)) < 0 || fstat(fd, &st) != 0)
+    {
+        fprintf(stderr, "Could not open %s: %s\n", filename, strerror(errno));
+        exit(1);
+    }
+
+    /* Binary traces start with the magic number, text traces with a digit */
+    if (read(fd, &header, sizeof(header)) == sizeof(header) &&
+        memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) == 0)
+        return load_binary(filename, fd, (size_t)st.st_size);
+
+    close(fd);
+    return load_text(filename);
+}
+
+/*
+ * load_binary - map a binary trace and use its requests in place
+ */
+static tracefile_t *load_binary(const char *filename, int fd, size_t len)
+{
+    tracefile_t *trace;
+    trace_header_t *header;
+    void *map;
+
+    map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        fprintf(stderr, "Could not map %s: %s\n", filename, strerror(errno));
+        exit(1);
+    }
+    header = map;
+
+    if (header->num_ids > INT32_MAX || header->num_ops > INT32_MAX)
+        trace_error(filename, "bad trace header");
+    if (len != sizeof(*header) + header->num_ops * sizeof(traceop_t))
+        trace_error(filename, "file size does not match the request count");
+
+    if ((trace = malloc(sizeof(tracefile_t))) == NULL)
+    {
+        fprintf(stderr, "malloc failed in trace_load\n");
+        exit(1);
+    }
+    trace->weight = (int)header->weight;
+    trace->num_ids = (int)header->num_ids;
+    trace->num_ops = (int)header->num_ops;
+    trace->data_bytes = header->data_bytes;
+    trace->ops = (traceop_t *)(header + 1);
+    trace->map = map;
+    trace->map_len = len;
+
+    /* The replay loops index their block tables without further checks */
+    check_ops(filename, trace);
+    return trace;
+}
+
+/*
+ * load_text - parse a text trace into a freshly allocated array of requests
+ */
+static tracefile_t *load_text(const char *filename)
+{
+    FILE *tracefile;
+    tracefile_t *trace;
+    char type[MAXLINE];
+    int index;
+    size_t size;
+    int op_index = 0;
+
+    if ((tracefile = fopen(filename, "r")) == NULL)
+    {
+        fprintf(stderr, "Could not open %s: %s\n", filename, strerror(errno));
+        exit(1);
+    }
+    if ((trace = malloc(sizeof(tracefile_t))) == NULL)
+    {
+        fprintf(stderr, "malloc failed in trace_load\n");
+        exit(1);
+    }
+    trace->map = NULL;
+    trace->map_len = 0;
+
+    if (fscanf(tracefile, "%d %d %d %zu", &trace->weight, &trace->num_ids,
+               &trace->num_ops, &trace->data_bytes) != 4 ||
+        trace->num_ids < 0 || trace->num_ops < 0)
+        trace_error(filename, "bad trace header");
+
+    if ((trace->ops = malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
+    {
+        fprintf(stderr, "malloc failed in trace_load\n");
+        exit(1);
+    }
+
+    while (op_index < trace->num_ops && fscanf(tracefile, "%s", type) != EOF)
+    {
+        traceop_t *op = &trace->ops[op_index];
+        int fields;
+
+        switch (type[0])
+        {
+        case 'a':
+            op->type = ALLOC;
+            fields = fscanf(tracefile, "%d %zu", &index, &size);
+            break;
+        case 'r':
+            op->type = REALLOC;
+            fields = fscanf(tracefile, "%d %zu", &index, &size);
+            break;
+        case 'f':
+            op->type = FREE;
+            size = 0;
+            fields = fscanf(tracefile, "%d", &index) + 1;
+            break;
+        default:
+            fprintf(stderr, "Bogus type character (%c) in tracefile %s\n",
+                    type[0], filename);
+            exit(1);
+        }
+        if (fields != 2)
+        {
+            fprintf(stderr, "%s: bad request on line %d\n", filename,
+                    op_index + 5);
+            exit(1);
+        }
+        op->index = index;
+        op->size = size;
+        op_index++;
+    }
+    fclose(tracefile);
+
+    if (op_index != trace->num_ops)
+        trace_error(filename, "fewer requests than the header promises");
+    check_ops(filename, trace);
+    return trace;
+}
+
+/*
+ * check_ops - make sure a trace is one the drivers can replay safely
+ */
+static void check_ops(const char *filename, const tracefile_t *trace)
+{
+    int max_index = -1;
+
+    if (trace->weight < 0 || trace->weight > 3)
+        trace_error(filename, "weight can only be in {0, 1, 2, 3}");
+
+    for (int i = 0; i < trace->num_ops; i++)
+    {
+        const traceop_t *op = &trace->ops[i];
+
+        /* A free of id -1 is a free(NULL) */
+        if (op->type > REALLOC || op->index < (op->type == FREE ? -1 : 0) ||
+            op->index >= trace->num_ids)
+        {
+            fprintf(stderr, "%s: bad request %d\n", filename, i);
+            exit(1);
+        }
+        if (op->type != FREE && op->index > max_index)
+            max_index = op->index;
+    }
+
+    if (max_index != trace->num_ids - 1)
+        trace_error(filename, "block ids don't match the header");
+}
+
+/*
+ * trace_close - release a trace returned by trace_load
+ */
+void trace_close(tracefile_t *trace)
+{
+    if (trace->map != NULL)
+        munmap(trace->map, trace->map_len);
+    else
+        free(trace->ops);
+    free(trace);
+}
+
+/*
+ * trace_write - write a trace in either format
+ */
+void trace_write(const char *filename, const tracefile_t *trace, bool binary)
+{
+    FILE *out;
+    bool ok;
+
+    if ((out = fopen(filename, binary ? "wb" : "w")) == NULL)
+    {
+        fprintf(stderr, "Could not create %s: %s\n", filename,
+                strerror(errno));
+        exit(1);
+    }
+
+    if (binary)
+    {
+        trace_header_t header;
+
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+        header.weight = (uint32_t)trace->weight;
+        header.num_ids = (uint32_t)trace->num_ids;
+        header.num_ops = (uint32_t)trace->num_ops;
+        header.data_bytes = trace->data_bytes;
+
+        ok = fwrite(&header, sizeof(header), 1, out) == 1 &&
+             fwrite(trace->ops, sizeof(traceop_t), (size_t)trace->num_ops,
+                    out) == (size_t)trace->num_ops;
+    }
+    else
+    {
+        ok = fprintf(out, "%d\n%d\n%d\n%zu\n", trace->weight, trace->num_ids,
+                     trace->num_ops, trace->data_bytes) > 0;
+        for (int i = 0; ok && i < trace->num_ops; i++)
+        {
+            const traceop_t *op = &trace->ops[i];
+
+            switch (op->type)
+            {
+            case ALLOC:
+                ok = fprintf(out, "a %d %zu\n", op->index,
+                             (size_t)op->size) > 0;
+                break;
+            case REALLOC:
+                ok = fprintf(out, "r %d %zu\n", op->index,
+                             (size_t)op->size) > 0;
+                break;
+            default:
+                ok = fprintf(out, "f %d\n", op->index) > 0;
+                break;
+            }
+        }
+    }
+
+    if (fclose(out) != 0 || !ok)
+    {
+        fprintf(stderr, "Could not write %s: %s\n", filename,
+                strerror(errno));
+        exit(1);
+    }
+}
+
+/*
+ * trace_error - report a malformed trace and exit
+ */
+static void trace_error(const char *filename, const char *msg)
+{
+    fprintf(stderr, "%s: %s\n", filename, msg);
+    exit(1);
+}
@@ -0,0 +1,87 @@
+/*
+ * trace.h - Reading and writing malloc lab trace files
+ *
+ * A trace comes in one of two formats:
+ *
+ * - Text (.rep): four header lines (weight, number of block ids, number of
+ *   requests, peak number of data bytes), then one request per line:
+ *   "a <id> <size>", "r <id> <size>" or "f <id>", where "f -1" is a
+ *   free(NULL).
+ *
+ * - Binary (.repb): a trace_header_t followed by the requests as an array of
+ *   traceop_t, in exactly the layout the drivers replay them from. A binary
+ *   trace is mmap'd and used in place, so loading it costs no parsing and
+ *   no copying. The numbers are stored in host byte order.
+ *
+ * trace_load accepts either format and tells them apart by the magic
+ * number at the start of binary traces.
+ */
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Extension of binary traces */
+#define BINARY_TRACE_EXT ".repb"
+
+/* Request types */
+typedef enum
+{
+    ALLOC,
+    FREE,
+    REALLOC
+} optype_t;
+
+/* A single trace operation (allocator request) */
+typedef struct
+{
+    uint32_t type;  /* type of request, an optype_t */
+    int32_t index;  /* index for free() to use later */
+    uint64_t size;  /* byte size of alloc/realloc request */
+} traceop_t;
+
+/* The header of a binary trace */
+typedef struct
+{
+    char magic[8];       /* TRACE_MAGIC */
+    uint32_t weight;     /* weight for this trace */
+    uint32_t num_ids;    /* number of alloc/realloc ids */
+    uint32_t num_ops;    /* number of requests */
+    uint32_t reserved;   /* zero; keeps the requests 16-byte aligned */
+    uint64_t data_bytes; /* peak number of data bytes allocated */
+} trace_header_t;
+
+#define TRACE_MAGIC "MLTRACE1"
+
+/* A loaded trace, in either format */
+typedef struct
+{
+    int weight;        /* weight for this trace */
+    int num_ids;       /* number of alloc/realloc ids */
+    int num_ops;       /* number of requests */
+    size_t data_bytes; /* peak number of data bytes allocated */
+    traceop_t *ops;    /* array of requests */
+    void *map;         /* mapping of a binary trace, NULL for text traces */
+    size_t map_len;    /* length of that mapping */
+} tracefile_t;
+
+/*
+ * Load a trace of either format.  If prefer_binary is set and filename names
+ * a text trace X.rep with an X.repb beside it that is at least as new, the
+ * binary trace is loaded instead.  Exits with a message on stderr if the
+ * file can't be read or is malformed.
+ */
+tracefile_t *trace_load(const char *filename, bool prefer_binary);
+
+/* Release a trace returned by trace_load */
+void trace_close(tracefile_t *trace);
+
+/*
+ * Write a trace to a file, in the binary format if binary is set and in the
+ * text format otherwise.  Exits with a message on stderr on failure.
+ */
+void trace_write(const char *filename, const tracefile_t *trace, bool binary);
+
+#endif /* TRACE_H */
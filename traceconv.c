@@ -0,0 +1,61 @@
+/*
+ * traceconv.c - Convert malloc lab traces between the text and binary formats
+ *
+ * The input may be in either format (see trace.h); the output is binary
+ * unless -t is given. For example,
+ *
+ *     ./traceconv traces/bdd-aa4.rep traces/bdd-aa4.repb
+ *
+ * writes the binary trace that mdriver then loads in place of the text one.
+ */
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+/*
+ * usage - Explain the command line arguments
+ */
+static void usage(char *prog)
+{
+    fprintf(stderr, "Usage: %s [-th] <in> <out>\n", prog);
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-t  Write a text (.rep) trace instead of a binary "
+                    "(" BINARY_TRACE_EXT ") one.\n");
+    fprintf(stderr, "\t-h  Print this message.\n");
+}
+
+int main(int argc, char **argv)
+{
+    bool binary = true;
+    int c;
+
+    while ((c = getopt(argc, argv, "th")) != EOF)
+    {
+        switch (c)
+        {
+        case 't': /* Write the text format */
+            binary = false;
+            break;
+        case 'h': /* Print this message */
+            usage(argv[0]);
+            exit(0);
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+    if (argc - optind != 2)
+    {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    /* Read exactly the named file: the output may be its binary sibling */
+    tracefile_t *trace = trace_load(argv[optind], false);
+    trace_write(argv[optind + 1], trace, binary);
+    trace_close(trace);
+    return 0;
+}
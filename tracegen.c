@@ -0,0 +1,490 @@
+/*
+ * tracegen.c - Generate synthetic malloc lab traces
+ *
+ * Writes a trace of -n requests in which blocks are allocated with sizes
+ * drawn from one distribution and freed after lifetimes, counted in
+ * requests, drawn from another; a share of the requests reallocate a live
+ * block to a multiple of its size. Every block still live when the request
+ * budget runs out is freed at the end, in the order its lifetime would have
+ * ended, so the trace has the same shape as the shipped ones: one id per
+ * allocation, each freed exactly once. When only one request is left over,
+ * too few for an allocation and its free, it reallocates a live block, so
+ * the trace always has exactly -n requests. For example,
+ *
+ *     ./tracegen -n 10000000 -S 'pow:8:4096:1.5@3,uniform:4096:65536' \
+ *         -l exp:5000 -r 0.05 -L 64000000 traces/stress.repb
+ *
+ * The output is binary if its name ends in .repb and text otherwise.
+ *
+ * A distribution is a list of components, each picked with a probability
+ * proportional to its weight (the number after '@', 1 if absent); sizes
+ * that come out below 1 byte are raised to 1:
+ *
+ *     fixed:N               always N
+ *     uniform:LO:HI         uniform over [LO, HI]
+ *     pow:LO:HI:ALPHA       power law over [LO, HI], density ~ x^-ALPHA
+ *     exp:MEAN              exponential with the given mean
+ *
+ * The generator has its own random number generator, so the same options
+ * and seed give the same trace on every run.
+ */
+#include <errno.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define MAX_COMPONENTS 16
+
+/* One component of a distribution */
+typedef struct
+{
+    enum
+    {
+        D_FIXED,
+        D_UNIFORM,
+        D_POW,
+        D_EXP
+    } kind;
+    double lo, hi;  /* bounds; lo is the value or the mean for fixed/exp */
+    double alpha;   /* exponent of pow */
+    double weight;  /* relative probability of this component */
+} component_t;
+
+typedef struct
+{
+    int count;
+    double total_weight;
+    component_t parts[MAX_COMPONENTS];
+} dist_t;
+
+/* A live block, in a min-heap on the request at which it dies */
+typedef struct
+{
+    uint64_t death;
+    int32_t id;
+} death_t;
+
+static uint64_t rng_state;
+
+/*
+ * next_random - splitmix64
+ */
+static uint64_t next_random(void)
+{
+    uint64_t z = (rng_state += 0x9e3779b97f4a7c15ULL);
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/* A uniform double in [0, 1) */
+static double uniform01(void)
+{
+    return (double)(next_random() >> 11) * 0x1p-53;
+}
+
+/*
+ * parse_dist - parse a distribution given on the command line; returns
+ *              false if it is malformed
+ */
+static bool parse_dist(const char *spec, dist_t *dist)
+{
+    char buf[1024], *save = NULL;
+
+    if (strlen(spec) >= sizeof(buf))
+        return false;
+    strcpy(buf, spec);
+    dist->count = 0;
+    dist->total_weight = 0;
+
+    for (char *tok = strtok_r(buf, ",", &save); tok != NULL;
+         tok = strtok_r(NULL, ",", &save))
+    {
+        component_t *c = &dist->parts[dist->count];
+        char *at = strchr(tok, '@');
+        char kind[16];
+        int n, used = 0;
+
+        if (dist->count == MAX_COMPONENTS)
+            return false;
+        c->weight = 1;
+        if (at != NULL)
+        {
+            *at = '\0';
+            if (sscanf(at + 1, "%lf%n", &c->weight, &used) != 1 ||
+                at[1 + used] != '\0' || !(c->weight > 0))
+                return false;
+        }
+
+        if (sscanf(tok, "%15[a-z]%n", kind, &used) != 1)
+            return false;
+        tok += used;
+        c->hi = c->alpha = 0;
+        if (strcmp(kind, "fixed") == 0)
+        {
+            c->kind = D_FIXED;
+            n = sscanf(tok, ":%lf%n", &c->lo, &used) == 1;
+        }
+        else if (strcmp(kind, "uniform") == 0)
+        {
+            c->kind = D_UNIFORM;
+            n = sscanf(tok, ":%lf:%lf%n", &c->lo, &c->hi, &used) == 2 &&
+                c->lo <= c->hi;
+        }
+        else if (strcmp(kind, "pow") == 0)
+        {
+            c->kind = D_POW;
+            n = sscanf(tok, ":%lf:%lf:%lf%n", &c->lo, &c->hi, &c->alpha,
+                       &used) == 3 &&
+                c->lo > 0 && c->lo <= c->hi;
+        }
+        else if (strcmp(kind, "exp") == 0)
+        {
+            c->kind = D_EXP;
+            n = sscanf(tok, ":%lf%n", &c->lo, &used) == 1;
+        }
+        else
+            return false;
+        if (!n || tok[used] != '\0' || c->lo < 0)
+            return false;
+
+        dist->total_weight += c->weight;
+        dist->count++;
+    }
+    return dist->count > 0;
+}
+
+/*
+ * sample - draw a value from a distribution
+ */
+static uint64_t sample(const dist_t *dist)
+{
+    const component_t *c = &dist->parts[dist->count - 1];
+    double pick = uniform01() * dist->total_weight;
+    double u, x;
+
+    for (int i = 0; i < dist->count; i++)
+    {
+        if (pick < dist->parts[i].weight)
+        {
+            c = &dist->parts[i];
+            break;
+        }
+        pick -= dist->parts[i].weight;
+    }
+
+    u = uniform01();
+    switch (c->kind)
+    {
+    case D_FIXED:
+        x = c->lo;
+        break;
+    case D_UNIFORM:
+        x = floor(c->lo + u * (c->hi - c->lo + 1));
+        if (x > c->hi)
+            x = c->hi;
+        break;
+    case D_POW:
+        if (fabs(c->alpha - 1) < 1e-9)
+            x = c->lo * pow(c->hi / c->lo, u);
+        else
+        {
+            double e = 1 - c->alpha;
+            double lo = pow(c->lo, e), hi = pow(c->hi, e);
+            x = pow(lo + u * (hi - lo), 1 / e);
+        }
+        x = floor(x);
+        break;
+    default:
+        x = floor(-c->lo * log1p(-u));
+        break;
+    }
+    return (uint64_t)x;
+}
+
+/*
+ * dist_max - a bound on the values a distribution gives in practice
+ */
+static uint64_t dist_max(const dist_t *dist)
+{
+    double max = 0;
+
+    for (int i = 0; i < dist->count; i++)
+    {
+        const component_t *c = &dist->parts[i];
+        double top = c->kind == D_FIXED ? c->lo
+                     : c->kind == D_EXP ? 20 * c->lo
+                                        : c->hi;
+        if (top > max)
+            max = top;
+    }
+    return (uint64_t)max;
+}
+
+/*
+ * The heap of live blocks, ordered by death and then by id, so that ties
+ * break the same way on every run
+ */
+static bool dies_before(const death_t *a, const death_t *b)
+{
+    return a->death < b->death || (a->death == b->death && a->id < b->id);
+}
+
+static void heap_push(death_t *heap, size_t *n, death_t d)
+{
+    size_t i = (*n)++;
+
+    while (i > 0 && dies_before(&d, &heap[(i - 1) / 2]))
+    {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = d;
+}
+
+static death_t heap_pop(death_t *heap, size_t *n)
+{
+    death_t top = heap[0], last = heap[--*n];
+    size_t i = 0;
+
+    for (;;)
+    {
+        size_t child = 2 * i + 1;
+
+        if (child >= *n)
+            break;
+        if (child + 1 < *n && dies_before(&heap[child + 1], &heap[child]))
+            child++;
+        if (!dies_before(&heap[child], &last))
+            break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    if (*n > 0)
+        heap[i] = last;
+    return top;
+}
+
+/*
+ * usage - Explain the command line arguments
+ */
+static void usage(char *prog)
+{
+    fprintf(stderr, "Usage: %s [-h] [-n <ops>] [-s <seed>] [-S <dist>] "
+                    "[-l <dist>]\n"
+                    "       [-r <ratio>] [-g <factor>] [-L <bytes>] "
+                    "[-w <weight>] <out>\n",
+            prog);
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-n <ops>     Number of requests (default 100000).\n");
+    fprintf(stderr, "\t-s <seed>    Random seed (default 1).\n");
+    fprintf(stderr, "\t-S <dist>    Request sizes in bytes "
+                    "(default pow:8:4096:1.5).\n");
+    fprintf(stderr, "\t-l <dist>    Block lifetimes in requests "
+                    "(default exp:1000).\n");
+    fprintf(stderr, "\t-r <ratio>   Share of requests that are reallocs "
+                    "(default 0).\n");
+    fprintf(stderr, "\t-g <factor>  Size change of a realloc, above 0 "
+                    "(default 1.5).\n");
+    fprintf(stderr, "\t-L <bytes>   Free early to keep the live bytes under "
+                    "this (default no limit).\n");
+    fprintf(stderr, "\t-w <weight>  Weight of the trace (default 1).\n");
+    fprintf(stderr, "\t-h           Print this message.\n");
+    fprintf(stderr, "A <dist> is a comma-separated list of fixed:N, "
+                    "uniform:LO:HI, pow:LO:HI:ALPHA\n"
+                    "or exp:MEAN, each optionally followed by @weight.\n");
+}
+
+/*
+ * parse_number - parse a non-negative option argument or exit
+ */
+static double parse_number(const char *arg, char opt)
+{
+    char *end;
+    double value;
+
+    errno = 0;
+    value = strtod(arg, &end);
+    if (errno != 0 || end == arg || *end != '\0' || !(value >= 0))
+    {
+        fprintf(stderr, "Bad argument to -%c: %s\n", opt, arg);
+        exit(1);
+    }
+    return value;
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t num_ops = 100000, seed = 1, live_target = 0;
+    double realloc_ratio = 0, growth = 1.5;
+    int weight = 1;
+    dist_t sizes, lifetimes;
+    int c;
+
+    parse_dist("pow:8:4096:1.5", &sizes);
+    parse_dist("exp:1000", &lifetimes);
+
+    while ((c = getopt(argc, argv, "n:s:S:l:r:g:L:w:h")) != EOF)
+    {
+        switch (c)
+        {
+        case 'n': /* Number of requests */
+            num_ops = (uint64_t)parse_number(optarg, 'n');
+            break;
+        case 's': /* Random seed */
+            seed = (uint64_t)parse_number(optarg, 's');
+            break;
+        case 'S': /* Size distribution */
+        case 'l': /* Lifetime distribution */
+            if (!parse_dist(optarg, c == 'S' ? &sizes : &lifetimes))
+            {
+                fprintf(stderr, "Bad distribution for -%c: %s\n", c, optarg);
+                exit(1);
+            }
+            break;
+        case 'r': /* Share of reallocs */
+            realloc_ratio = parse_number(optarg, 'r');
+            break;
+        case 'g': /* Realloc size factor */
+            growth = parse_number(optarg, 'g');
+            break;
+        case 'L': /* Live bytes target */
+            live_target = (uint64_t)parse_number(optarg, 'L');
+            break;
+        case 'w': /* Trace weight */
+            weight = (int)parse_number(optarg, 'w');
+            break;
+        case 'h': /* Print this message */
+            usage(argv[0]);
+            exit(0);
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+    if (argc - optind != 1)
+    {
+        usage(argv[0]);
+        exit(1);
+    }
+    if (num_ops > INT32_MAX || num_ops == 1 || realloc_ratio > 1)
+    {
+        fprintf(stderr, "Need 0 or 2 to %d requests and a realloc ratio of "
+                        "at most 1\n",
+                INT32_MAX);
+        exit(1);
+    }
+    if (!(growth > 0))
+    {
+        fprintf(stderr, "Need a realloc factor above 0\n");
+        exit(1);
+    }
+
+    size_t max_ids = num_ops / 2 + 1;
+    traceop_t *ops = malloc((num_ops + 1) * sizeof(traceop_t));
+    uint64_t *block_size = malloc(max_ids * sizeof(uint64_t));
+    int32_t *live = malloc(max_ids * sizeof(int32_t));  /* live ids */
+    int32_t *live_pos = malloc(max_ids * sizeof(int32_t));
+    death_t *heap = malloc(max_ids * sizeof(death_t));
+    if (!ops || !block_size || !live || !live_pos || !heap)
+    {
+        fprintf(stderr, "Out of memory for %lu requests\n",
+                (unsigned long)num_ops);
+        exit(1);
+    }
+
+    uint64_t max_size = dist_max(&sizes);
+    if (max_size < 1)
+        max_size = 1;
+    uint64_t t = 0, live_bytes = 0, peak_bytes = 0;
+    size_t num_live = 0, heap_len = 0;
+    int32_t num_ids = 0;
+
+    rng_state = seed;
+
+    /*
+     * Leave room in the budget for freeing every live block at the end; an
+     * allocation takes two requests of what is left over, a realloc one
+     */
+    while (t + num_live < num_ops)
+    {
+        uint64_t spare = num_ops - t - num_live;
+        bool must_free =
+            heap_len > 0 && spare > 1 &&
+            (heap[0].death <= t ||
+             (live_target > 0 && live_bytes >= live_target));
+        double u = uniform01();
+
+        if (must_free)
+        {
+            death_t d = heap_pop(heap, &heap_len);
+            int32_t moved = live[--num_live];
+
+            live[live_pos[d.id]] = moved;
+            live_pos[moved] = live_pos[d.id];
+            live_bytes -= block_size[d.id];
+            ops[t++] = (traceop_t){FREE, d.id, 0};
+        }
+        else if (num_live > 0 && (u < realloc_ratio || spare == 1))
+        {
+            int32_t id = live[next_random() % num_live];
+            double grown = ceil((double)block_size[id] * growth);
+            uint64_t size = grown > (double)max_size ? max_size
+                                                     : (uint64_t)grown;
+
+            live_bytes = live_bytes - block_size[id] + size;
+            block_size[id] = size;
+            ops[t++] = (traceop_t){REALLOC, id, size};
+        }
+        else
+        {
+            int32_t id = num_ids++;
+            uint64_t lifetime = sample(&lifetimes);
+            uint64_t size = sample(&sizes);
+
+            block_size[id] = size > 0 ? size : 1;
+            live_pos[id] = (int32_t)num_live;
+            live[num_live++] = id;
+            heap_push(heap, &heap_len,
+                      (death_t){t + (lifetime > 0 ? lifetime : 1), id});
+            live_bytes += block_size[id];
+            ops[t++] = (traceop_t){ALLOC, id, block_size[id]};
+        }
+
+        if (live_bytes > peak_bytes)
+            peak_bytes = live_bytes;
+    }
+
+    /* Free what is left, in the order the blocks would have died */
+    while (heap_len > 0)
+    {
+        death_t d = heap_pop(heap, &heap_len);
+        ops[t++] = (traceop_t){FREE, d.id, 0};
+    }
+
+    size_t len = strlen(argv[optind]), ext = strlen(BINARY_TRACE_EXT);
+    tracefile_t trace = {
+        .weight = weight,
+        .num_ids = num_ids,
+        .num_ops = (int)t,
+        .data_bytes = (size_t)peak_bytes,
+        .ops = ops,
+    };
+    trace_write(argv[optind], &trace,
+                len > ext &&
+                    strcmp(argv[optind] + len - ext, BINARY_TRACE_EXT) == 0);
+
+    free(ops);
+    free(block_size);
+    free(live);
+    free(live_pos);
+    free(heap);
+    return 0;
+}
@@ -0,0 +1,367 @@
+/*
+ * tracestat.c - Describe the shape of malloc lab traces
+ *
+ * Reads traces of either format (see trace.h) and prints, as JSON, what an
+ * allocator would want to know before choosing its size classes:
+ *
+ * - counts of each kind of request and the trace header
+ * - the request sizes of allocs and reallocs, in power-of-two buckets
+ * - the hot sizes: the most requested exact sizes, in decreasing order of
+ *   requests, until they cover 90% of the requests
+ * - how reallocs change the size of their block, and how many times a
+ *   block is reallocated
+ * - block lifetimes, counted in requests from allocation to free
+ * - the peak of live bytes, and the live bytes sampled at evenly spaced
+ *   points through the trace
+ *
+ * One trace gives one JSON object; several give an array of them. Sizes are
+ * requested sizes, not what an allocator would round them up to.
+ */
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define SIZE_BUCKETS 65         /* [0], [1], [2,3], [4,7], ... */
+#define HOT_COVERAGE 0.9        /* share of requests the hot sizes cover */
+#define DEFAULT_POINTS 100      /* samples in the live bytes timeline */
+
+/*
+ * Reallocs are counted by the ratio of new to old size: below the first
+ * bound, below each later one, then the rest. The bounds just above 1 split
+ * off the reallocs that leave the size alone.
+ */
+static const double growth_bounds[] = {0.5, 1, 1.0000001, 1.25, 1.5, 2, 4};
+#define GROWTH_BUCKETS (sizeof(growth_bounds) / sizeof(growth_bounds[0]) + 1)
+static const char *const growth_names[GROWTH_BUCKETS] = {
+    "<0.5", "0.5-1", "1", "1-1.25", "1.25-1.5", "1.5-2", "2-4", ">=4"};
+
+/* Per-trace results */
+typedef struct
+{
+    uint64_t count[3];                /* requests of each optype_t */
+    uint64_t size_count[SIZE_BUCKETS];
+    uint64_t size_bytes[SIZE_BUCKETS];
+    uint64_t growth[GROWTH_BUCKETS];
+    uint64_t max_chain;               /* most reallocs of one block */
+    uint64_t chained;                 /* blocks reallocated at least once */
+    uint64_t never_freed;
+    uint64_t live, peak, peak_op;
+} stats_t;
+
+/*
+ * usage - Explain the command line arguments
+ */
+static void usage(char *prog)
+{
+    fprintf(stderr, "Usage: %s [-h] [-p <points>] <trace>...\n", prog);
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-p <points>  Samples in the live bytes timeline "
+                    "(default %d).\n",
+            DEFAULT_POINTS);
+    fprintf(stderr, "\t-h           Print this message.\n");
+}
+
+/* The size bucket of a request: 0, then one per power of two */
+static int size_bucket(uint64_t size)
+{
+    return size == 0 ? 0 : 64 - __builtin_clzll(size);
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* A distinct size and the number of requests for it */
+typedef struct
+{
+    uint64_t size;
+    uint64_t count;
+} size_count_t;
+
+static int by_count(const void *a, const void *b)
+{
+    const size_count_t *x = a, *y = b;
+
+    if (x->count != y->count)
+        return x->count < y->count ? 1 : -1;
+    return (x->size > y->size) - (x->size < y->size);
+}
+
+/*
+ * print_quantiles - print quantiles of a sorted array as a JSON object
+ */
+static void print_quantiles(const uint64_t *v, size_t n)
+{
+    static const double q[] = {0.5, 0.9, 0.99, 0.999};
+
+    printf("{\"count\": %zu", n);
+    for (size_t i = 0; i < sizeof(q) / sizeof(q[0]); i++)
+    {
+        size_t rank = (size_t)ceil(q[i] * (double)n);
+        rank = rank == 0 ? 0 : rank - 1;
+        printf(", \"p%g\": %lu", 100 * q[i],
+               n == 0 ? 0UL : (unsigned long)v[rank]);
+    }
+    printf(", \"max\": %lu}", n == 0 ? 0UL : (unsigned long)v[n - 1]);
+}
+
+/*
+ * print_hot_sizes - sort the request sizes and print the most frequent
+ *                   ones that together make up HOT_COVERAGE of them
+ */
+static void print_hot_sizes(uint64_t *sizes, size_t n)
+{
+    size_count_t *runs = malloc((n + 1) * sizeof(size_count_t));
+    size_t nruns = 0;
+    uint64_t covered = 0;
+
+    if (runs == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    qsort(sizes, n, sizeof(uint64_t), compare_u64);
+    for (size_t i = 0; i < n; i++)
+    {
+        if (nruns == 0 || runs[nruns - 1].size != sizes[i])
+            runs[nruns++] = (size_count_t){sizes[i], 0};
+        runs[nruns - 1].count++;
+    }
+    qsort(runs, nruns, sizeof(size_count_t), by_count);
+
+    printf("  \"distinct_sizes\": %zu,\n  \"hot_sizes\": [", nruns);
+    for (size_t i = 0; i < nruns && covered < HOT_COVERAGE * (double)n; i++)
+    {
+        covered += runs[i].count;
+        printf("%s\n    {\"size\": %lu, \"count\": %lu, \"coverage\": %.4f}",
+               i == 0 ? "" : ",", (unsigned long)runs[i].size,
+               (unsigned long)runs[i].count, (double)covered / (double)n);
+    }
+    printf("\n  ],\n");
+    free(runs);
+}
+
+/*
+ * analyze - print the description of one trace
+ */
+static void analyze(const char *filename, int points)
+{
+    tracefile_t *trace = trace_load(filename, true);
+    size_t num_ids = (size_t)trace->num_ids;
+    uint64_t *cur_size = calloc(num_ids + 1, sizeof(uint64_t));
+    uint64_t *born = calloc(num_ids + 1, sizeof(uint64_t));
+    uint32_t *reallocs = calloc(num_ids + 1, sizeof(uint32_t));
+    bool *live = calloc(num_ids + 1, sizeof(bool));
+    size_t num_ops = (size_t)trace->num_ops;
+    uint64_t *sizes = malloc((num_ops + 1) * sizeof(uint64_t));
+    uint64_t *lifetimes = malloc((num_ops + 1) * sizeof(uint64_t));
+    size_t nsizes = 0, nlifetimes = 0;
+    uint64_t next_point = 0;
+    int point = 0;
+    stats_t st;
+
+    if (!cur_size || !born || !reallocs || !live || !sizes || !lifetimes)
+    {
+        fprintf(stderr, "Out of memory for %s\n", filename);
+        exit(1);
+    }
+    memset(&st, 0, sizeof(st));
+
+    printf("{\n  \"trace\": \"");
+    for (const char *p = filename; *p != '\0'; p++)
+    {
+        if (*p == '"' || *p == '\\')
+            putchar('\\');
+        putchar(*p);
+    }
+    printf("\",\n");
+    printf("  \"weight\": %d,\n  \"num_ids\": %d,\n  \"num_ops\": %d,\n"
+           "  \"data_bytes\": %zu,\n",
+           trace->weight, trace->num_ids, trace->num_ops, trace->data_bytes);
+
+    /* The timeline is printed as the trace is walked */
+    printf("  \"live_timeline\": [");
+    if (points > trace->num_ops)
+        points = trace->num_ops;
+    if (points > 0)
+        next_point = (uint64_t)trace->num_ops / (uint64_t)points - 1;
+
+    for (int i = 0; i < trace->num_ops; i++)
+    {
+        const traceop_t *op = &trace->ops[i];
+        int id = op->index;
+
+        st.count[op->type]++;
+        switch (op->type)
+        {
+        case ALLOC:
+            sizes[nsizes++] = op->size;
+            st.size_count[size_bucket(op->size)]++;
+            st.size_bytes[size_bucket(op->size)] += op->size;
+            if (live[id]) /* an id allocated twice; drop the old block */
+                st.live -= cur_size[id];
+            cur_size[id] = op->size;
+            born[id] = (uint64_t)i;
+            live[id] = true;
+            st.live += op->size;
+            break;
+
+        case REALLOC:
+        {
+            double ratio;
+            size_t b = 0;
+
+            sizes[nsizes++] = op->size;
+            st.size_count[size_bucket(op->size)]++;
+            st.size_bytes[size_bucket(op->size)] += op->size;
+            ratio = cur_size[id] == 0 ? 1e300
+                                      : (double)op->size /
+                                            (double)cur_size[id];
+            while (b < GROWTH_BUCKETS - 1 && ratio >= growth_bounds[b])
+                b++;
+            st.growth[b]++;
+            if (reallocs[id]++ == 0)
+                st.chained++;
+            if (reallocs[id] > st.max_chain)
+                st.max_chain = reallocs[id];
+            st.live = st.live - cur_size[id] + op->size;
+            cur_size[id] = op->size;
+            break;
+        }
+
+        default:
+            if (id < 0 || !live[id]) /* free(NULL), or of a freed block */
+                break;
+            lifetimes[nlifetimes++] = (uint64_t)i - born[id];
+            st.live -= cur_size[id];
+            live[id] = false;
+            break;
+        }
+
+        if (st.live > st.peak)
+        {
+            st.peak = st.live;
+            st.peak_op = (uint64_t)i;
+        }
+        if (point < points && (uint64_t)i == next_point)
+        {
+            printf("%s\n    [%d, %lu]", point == 0 ? "" : ",", i,
+                   (unsigned long)st.live);
+            point++;
+            next_point = (uint64_t)trace->num_ops * (uint64_t)(point + 1) /
+                             (uint64_t)points -
+                         1;
+        }
+    }
+    printf("\n  ],\n");
+
+    for (size_t id = 0; id < num_ids; id++)
+        st.never_freed += live[id];
+
+    printf("  \"requests\": {\"alloc\": %lu, \"realloc\": %lu, "
+           "\"free\": %lu},\n",
+           (unsigned long)st.count[ALLOC], (unsigned long)st.count[REALLOC],
+           (unsigned long)st.count[FREE]);
+    printf("  \"live_bytes\": {\"peak\": %lu, \"peak_op\": %lu, "
+           "\"end\": %lu},\n",
+           (unsigned long)st.peak, (unsigned long)st.peak_op,
+           (unsigned long)st.live);
+
+    /* Request sizes */
+    printf("  \"size_histogram\": [");
+    for (int b = 0, first = 1; b < SIZE_BUCKETS; b++)
+    {
+        uint64_t lo = b == 0 ? 0 : (uint64_t)1 << (b - 1);
+        uint64_t hi = b == 0 ? 0 : b == 64 ? UINT64_MAX : 2 * lo - 1;
+
+        if (st.size_count[b] == 0)
+            continue;
+        printf("%s\n    {\"min\": %lu, \"max\": %lu, \"count\": %lu, "
+               "\"bytes\": %lu}",
+               first ? "" : ",", (unsigned long)lo, (unsigned long)hi,
+               (unsigned long)st.size_count[b],
+               (unsigned long)st.size_bytes[b]);
+        first = 0;
+    }
+    printf("\n  ],\n");
+    print_hot_sizes(sizes, nsizes); /* sorts sizes */
+    printf("  \"request_size\": ");
+    print_quantiles(sizes, nsizes);
+    printf(",\n");
+
+    /* Reallocs */
+    printf("  \"realloc\": {\"blocks\": %lu, \"max_per_block\": %lu, "
+           "\"growth\": [",
+           (unsigned long)st.chained, (unsigned long)st.max_chain);
+    for (size_t b = 0; b < GROWTH_BUCKETS; b++)
+    {
+        printf("%s\n    {\"ratio\": \"%s\", \"count\": %lu}",
+               b == 0 ? "" : ",", growth_names[b],
+               (unsigned long)st.growth[b]);
+    }
+    printf("\n  ]},\n");
+
+    /* Lifetimes */
+    qsort(lifetimes, nlifetimes, sizeof(uint64_t), compare_u64);
+    printf("  \"lifetime_ops\": ");
+    print_quantiles(lifetimes, nlifetimes);
+    printf(",\n  \"never_freed\": %lu\n}", (unsigned long)st.never_freed);
+
+    free(cur_size);
+    free(born);
+    free(reallocs);
+    free(live);
+    free(sizes);
+    free(lifetimes);
+    trace_close(trace);
+}
+
+int main(int argc, char **argv)
+{
+    int points = DEFAULT_POINTS;
+    int c;
+
+    while ((c = getopt(argc, argv, "p:h")) != EOF)
+    {
+        switch (c)
+        {
+        case 'p': /* Timeline samples */
+            points = atoi(optarg);
+            if (points < 0)
+            {
+                usage(argv[0]);
+                exit(1);
+            }
+            break;
+        case 'h': /* Print this message */
+            usage(argv[0]);
+            exit(0);
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+    if (optind == argc)
+    {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    bool many = argc - optind > 1;
+    if (many)
+        printf("[\n");
+    for (int i = optind; i < argc; i++)
+    {
+        analyze(argv[i], points);
+        printf("%s\n", !many ? "" : i + 1 < argc ? "," : "\n]");
+    }
+    return 0;
+}